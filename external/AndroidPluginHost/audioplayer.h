@@ -1,35 +1,118 @@
 #ifndef ANDROIDPLUGINHOST_AUDIOPLAYER_H
 #define ANDROIDPLUGINHOST_AUDIOPLAYER_H
 
+#include <atomic>
 #include <juce_audio_processors/juce_audio_processors.h>
+#include "samplecache.h"
 #include "sample_wav.h"
 
 using namespace juce;
 
+// Plays either a pre-decoded sample from the SampleCache (the audio thread only copies samples out of it),
+// or a file too large for that, streamed through AudioTransportSource with background read-ahead.
+// When processing non-realtime (offline rendering), nothing is left to the background threads: samples are
+// decoded before playback starts, and large files are read on the rendering thread.
 class AudioFilePlayerProcessor : public AudioProcessor
 {
+    static constexpr size_t maxDecodedBytes = 64 * 1024 * 1024;
+    static constexpr int readAheadSamples = 65536;
+
     AudioTransportSource transportSource{};
+    std::unique_ptr<AudioFormatReaderSource> readerSource{};
+    TimeSliceThread readAheadThread{"AudioFilePlayer read-ahead"};
+    AudioFormatManager audioFormatManager{};
+
+    // Each trigger is published separately, even of the same sample, so that the audio thread can tell them apart.
+    struct Publication : public ReferenceCountedObject {
+        using Ptr = ReferenceCountedObjectPtr<Publication>;
+        explicit Publication(DecodedSample::Ptr sample) : sample(std::move(sample)) {}
+        DecodedSample::Ptr sample;
+    };
+
+    // The audio thread picks up nextPublication and reports it back via playingPublication. Publications are kept
+    // alive here until the audio thread has moved past them, so that it never releases (frees) anything.
+    std::atomic<Publication*> nextPublication{nullptr};
+    std::atomic<Publication*> playingPublication{nullptr};
+    CriticalSection publishLock{};
+    ReferenceCountedArray<Publication> publications{};
+
+    // audio thread only
+    DecodedSample* currentSample{nullptr};
+    int64 position{0};
+    std::atomic<bool> looping{false};
+
+    // declared last, so that pending decoding jobs (which publish into the members above) finish first.
+    SampleCache sampleCache{};
 
 public:
     AudioFilePlayerProcessor()
     : AudioProcessor(BusesProperties().withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
                              .withOutput ("Output", juce::AudioChannelSet::stereo(), true)) {
+        audioFormatManager.registerBasicFormats();
+        readAheadThread.startThread();
     }
     ~AudioFilePlayerProcessor() override {
         transportSource.stop();
+        transportSource.setSource(nullptr);
         transportSource.releaseResources();
+        readAheadThread.stopThread(1000);
     }
 
-    AudioTransportSource& getTransportSource() { return transportSource; }
-
-    void playLoadedFile() {
-        AudioFormatManager audioFormatManager;
+    static AudioFormatReader* createSampleReader() {
         WavAudioFormat format;
         auto stream = new MemoryInputStream(resources_sample_wav, resources_sample_wav_len, false);
-        auto audioFormatReader = format.createReaderFor(stream, true);
-        auto audioFormatReaderSource = new AudioFormatReaderSource(audioFormatReader, true);
-        transportSource.setSource(audioFormatReaderSource);
-        transportSource.start();
+        return format.createReaderFor(stream, true);
+    }
+
+    String getSupportedFilePatterns() { return audioFormatManager.getWildcardForAllFormats(); }
+
+    void setLooping(bool shouldLoop) {
+        looping = shouldLoop;
+        if (readerSource != nullptr)
+            readerSource->setLooping(shouldLoop);
+    }
+
+    void playLoadedFile() {
+        playDecoded("embedded:sample.wav", [] { return std::unique_ptr<AudioFormatReader>(createSampleReader()); });
+    }
+
+    // Returns false if the file cannot be read.
+    bool playFile(const File& file) {
+        std::unique_ptr<AudioFormatReader> reader{audioFormatManager.createReaderFor(file)};
+        if (reader == nullptr)
+            return false;
+        if (getDecodedBytes(*reader) <= maxDecodedBytes) {
+            playDecoded(file.getFullPathName() + ":" + String(file.getLastModificationTime().toMilliseconds()),
+                        [this, file] { return std::unique_ptr<AudioFormatReader>(audioFormatManager.createReaderFor(file)); });
+            return true;
+        }
+        // prefer a memory-mapped reader so that the read-ahead thread does not go through the stream API.
+        if (auto format = audioFormatManager.findFormatForFileExtension(file.getFileExtension())) {
+            std::unique_ptr<MemoryMappedAudioFormatReader> mapped{format->createMemoryMappedReader(file)};
+            if (mapped != nullptr && mapped->mapEntireFile())
+                reader = std::move(mapped);
+        }
+        stream(reader.release());
+        return true;
+    }
+
+    // What a file chooser returns, e.g. content:// URIs on Android. Those cannot be memory mapped, and are not
+    // checked for changes once cached.
+    bool playURL(const URL& url) {
+        if (url.isLocalFile())
+            return playFile(url.getLocalFile());
+        auto createReader = [this, url] {
+            return std::unique_ptr<AudioFormatReader>(audioFormatManager.createReaderFor(
+                    url.createInputStream(URL::InputStreamOptions(URL::ParameterHandling::inAddress))));
+        };
+        auto reader = createReader();
+        if (reader == nullptr)
+            return false;
+        if (getDecodedBytes(*reader) <= maxDecodedBytes)
+            playDecoded(url.toString(false), std::move(createReader));
+        else
+            stream(reader.release());
+        return true;
     }
 
     void releaseResources() override { transportSource.releaseResources(); }
@@ -37,7 +120,29 @@ public:
         transportSource.prepareToPlay(samplesPerBlock, sampleRate);
     }
     void processBlock(AudioBuffer<float>& buffer, MidiBuffer& midiBuffer) override {
-        transportSource.getNextAudioBlock(AudioSourceChannelInfo{buffer});
+        if (auto publication = nextPublication.exchange(nullptr)) {
+            currentSample = publication->sample.get();
+            position = 0;
+            playingPublication = publication;
+        }
+
+        // a sample decoded for another rate (the device has changed since) is not played.
+        if (currentSample == nullptr || position >= currentSample->getLength() || currentSample->getSampleRate() != getSampleRate()) {
+            transportSource.getNextAudioBlock(AudioSourceChannelInfo{buffer});
+            return;
+        }
+
+        buffer.clear();
+        auto length = currentSample->getLength();
+        for (int offset = 0; offset < buffer.getNumSamples() && position < length;) {
+            auto n = (int) jmin((int64) (buffer.getNumSamples() - offset), length - position);
+            for (int ch = 0; ch < buffer.getNumChannels(); ch++)
+                buffer.copyFrom(ch, offset, currentSample->getReadPointer(jmin(ch, currentSample->getNumChannels() - 1)) + position, n);
+            offset += n;
+            position += n;
+            if (position >= length && looping)
+                position = 0;
+        }
     }
     AudioProcessorEditor* createEditor() override { return nullptr; }
     bool hasEditor() const override { return false; }
@@ -52,6 +157,50 @@ public:
     void setCurrentProgram(int index) override {}
     const String getProgramName(int index) override { return String(); }
     void changeProgramName(int index, const String &newName) override {}
+
+private:
+    static size_t getDecodedBytes(const AudioFormatReader& reader) {
+        return (size_t) reader.lengthInSamples * reader.numChannels * sizeof(float);
+    }
+
+    void playDecoded(const String& key, SampleCache::ReaderFactory createReader) {
+        transportSource.stop();
+        auto sampleRate = getSampleRate();
+        if (sampleRate <= 0)
+            return; // not prepared yet
+        if (isNonRealtime()) {
+            if (auto reader = createReader())
+                publish(DecodedSample::decode(*reader, sampleRate));
+            return;
+        }
+        sampleCache.request(key, sampleRate, std::move(createReader), [this](DecodedSample::Ptr sample) { publish(sample); });
+    }
+
+    // Takes the ownership of the reader.
+    void stream(AudioFormatReader* audioFormatReader) {
+        auto readAheadSize = isNonRealtime() ? 0 : readAheadSamples;
+        publish(new DecodedSample(0, 0, getSampleRate())); // stops the decoded sample, if any
+        auto audioFormatReaderSource = std::make_unique<AudioFormatReaderSource>(audioFormatReader, true);
+        audioFormatReaderSource->setLooping(looping);
+        transportSource.setSource(audioFormatReaderSource.get(), readAheadSize,
+                                  readAheadSize > 0 ? &readAheadThread : nullptr, audioFormatReader->sampleRate);
+        readerSource = std::move(audioFormatReaderSource);
+        transportSource.start();
+    }
+
+    void publish(DecodedSample::Ptr sample) {
+        const ScopedLock sl(publishLock);
+        Publication::Ptr publication{new Publication(std::move(sample))};
+        publications.add(publication);
+        // what the audio thread has not picked up yet never will be, as it was just replaced.
+        if (auto replaced = nextPublication.exchange(publication.get()))
+            publications.removeObject(replaced);
+
+        // anything published before what is playing now will never be touched by the audio thread again.
+        auto playingIndex = publications.indexOf(playingPublication.load());
+        if (playingIndex > 0)
+            publications.removeRange(0, playingIndex);
+    }
 };
 
 #endif //ANDROIDPLUGINHOST_AUDIOPLAYER_H
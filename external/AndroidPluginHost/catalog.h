@@ -0,0 +1,679 @@
+#ifndef ANDROIDPLUGINHOST_CATALOG_H
+#define ANDROIDPLUGINHOST_CATALOG_H
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+#include <vector>
+#include <juce_audio_processors/juce_audio_processors.h>
+
+using namespace juce;
+
+// The known plugins in a compact file that is memory mapped instead of parsed, so that startup does not
+// depend on the number of plugins. Records are sorted by format, vendor and name, so that the plugins of a
+// format or a vendor are a contiguous range; the format and vendor tables point to those ranges, and a
+// separate index sorts the records by lowercased name for type-ahead search.
+//
+// Changes (new plugins, removed plugins, blacklisting) are appended to a small journal next to the file and
+// kept in memory as an overlay, until the journal is large enough to be worth compacting into a new file.
+//
+// Entry IDs are stable until the next compaction: the records of the file come first, then the overlay. The
+// journal refers to removed entries by their ID, so that replaying it does not need to look anything up.
+//
+// Loading reads the header only. The references within the file (strings, ranges, the name index) are checked
+// when they are read, so that a damaged file yields empty values instead of reads out of bounds; the damage is
+// remembered, and the next applyChanges() (i.e. a rescan) writes a new file.
+//
+// All words in the file are 32-bit little endian. Strings are referred to by their offset in the string
+// pool at the end, where each of them is a length followed by the UTF-8 bytes and a terminating zero.
+class PluginCatalog {
+public:
+    static constexpr uint32 magic = 0x43485041; // "APHC"
+    static constexpr uint32 formatVersion = 1;
+    static constexpr int compactThreshold = 64; // journal entries
+
+    explicit PluginCatalog(File file) : file(file), journalFile(file.withFileExtension("journal")) {}
+
+    // Maps the file and replays the journal. Returns false if there is no (valid) catalog file yet.
+    // A damaged file is replaced with what the journal has (see isDamaged()).
+    bool load() {
+        mapped.reset();
+        numRecords = numFormats = numVendors = 0;
+        added.clear();
+        removed.clear();
+        blacklist.clear();
+        identifierIndex.clear();
+        journalEntries = 0;
+
+        bool valid = false;
+        if (file.existsAsFile()) {
+            mapped = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+            valid = validate();
+            if (!valid) {
+                mapped.reset();
+                damaged = foundDamaged = true;
+            }
+        }
+        if (valid) {
+            numRecords = header(hNumRecords);
+            numFormats = header(hNumFormats);
+            numVendors = header(hNumVendors);
+            for (uint32 i = 0, n = header(hNumBlacklisted); i < n; i++)
+                blacklist.add(getString(word(header(hBlacklist) + i * 4)));
+        }
+        removed.resize(numRecords, false);
+        replayJournal();
+        if (!valid && damaged && file.existsAsFile()) {
+            file.deleteFile();
+            compactIfNeeded(); // into a new file with whatever the journal knows
+        }
+        return valid;
+    }
+
+    // The catalog file was found broken in this session, so what it had is only back after a rescan (which is
+    // quick, as the scan cache still knows the unchanged files). Some damage is only found when it is read.
+    bool isDamaged() const { return foundDamaged || damaged; }
+
+    // The number of entry IDs, including removed entries.
+    int getNumEntries() const { return (int) (numRecords + added.size()); }
+    bool isRemoved(int id) const { return removed[(size_t) id]; }
+
+    int getNumTypes() const {
+        return (int) std::count(removed.begin(), removed.end(), false);
+    }
+
+    template <typename Func>
+    void forEachType(Func&& func) const {
+        for (int id = 0, n = getNumEntries(); id < n; id++)
+            if (!isRemoved(id))
+                func(id);
+    }
+
+    PluginDescription getDescription(int id) const {
+        if (id >= (int) numRecords)
+            return added[(size_t) id - numRecords];
+        PluginDescription desc{};
+        desc.name = getString(field(id, rName));
+        desc.descriptiveName = getString(field(id, rDescriptiveName));
+        desc.pluginFormatName = getString(field(id, rFormat));
+        desc.category = getString(field(id, rCategory));
+        desc.manufacturerName = getString(field(id, rManufacturer));
+        desc.version = getString(field(id, rVersion));
+        desc.fileOrIdentifier = getString(field(id, rFileOrIdentifier));
+        desc.uniqueId = (int) field(id, rUniqueId);
+        desc.deprecatedUid = (int) field(id, rDeprecatedUid);
+        desc.isInstrument = (field(id, rFlags) & flagInstrument) != 0;
+        desc.hasSharedContainer = (field(id, rFlags) & flagSharedContainer) != 0;
+        desc.hasARAExtension = (field(id, rFlags) & flagARAExtension) != 0;
+        desc.numInputChannels = (int) field(id, rNumInputs);
+        desc.numOutputChannels = (int) field(id, rNumOutputs);
+        desc.lastFileModTime = Time(getInt64(id, rFileModTimeLow));
+        desc.lastInfoUpdateTime = Time(getInt64(id, rInfoTimeLow));
+        return desc;
+    }
+
+    String getDescriptiveName(int id) const {
+        return id >= (int) numRecords ? added[(size_t) id - numRecords].descriptiveName : getString(field(id, rDescriptiveName));
+    }
+
+    String getIdentifier(int id) const {
+        return id >= (int) numRecords ? added[(size_t) id - numRecords].createIdentifierString() : getString(field(id, rIdentifier));
+    }
+
+    // Returns -1 if there is no such plugin. The first call builds the lookup table.
+    int findIdentifier(const String& identifier) {
+        if (identifierIndex.empty())
+            forEachType([&](int id) { identifierIndex[getIdentifier(id)] = id; });
+        auto it = identifierIndex.find(identifier);
+        return it != identifierIndex.end() ? it->second : -1;
+    }
+
+    // Exact match on either the name or the descriptive name. Returns -1 if there is no such plugin.
+    int findName(const String& name) const {
+        for (int id = 0, n = getNumEntries(); id < n; id++) {
+            if (isRemoved(id))
+                continue;
+            if (id >= (int) numRecords) {
+                auto& desc = added[(size_t) id - numRecords];
+                if (desc.name == name || desc.descriptiveName == name)
+                    return id;
+            } else if (getString(field(id, rName)) == name || getString(field(id, rDescriptiveName)) == name)
+                return id;
+        }
+        return -1;
+    }
+
+    // Unique vendor names of the format, sorted. An empty name is included if there are plugins without one.
+    StringArray getVendors(const String& formatName) const {
+        StringArray vendors{};
+        auto format = findFormat(formatName);
+        if (format >= 0) {
+            auto first = range(header(hFormats), format, gFirstVendor);
+            auto count = range(header(hFormats), format, gNumVendors);
+            checkRange(first, count, numVendors);
+            for (uint32 v = first, end = first + count; v < end; v++)
+                if (hasLiveRecord(range(header(hVendors), v, gFirst), range(header(hVendors), v, gCount)))
+                    vendors.add(getString(range(header(hVendors), v, gName)));
+        }
+        bool sortNeeded = false;
+        forEachAdded([&](int, const PluginDescription& desc) {
+            if (desc.pluginFormatName == formatName && !vendors.contains(desc.manufacturerName)) {
+                vendors.add(desc.manufacturerName);
+                sortNeeded = true;
+            }
+        });
+        if (sortNeeded)
+            vendors.sort(false);
+        return vendors;
+    }
+
+    // All the plugins of the format, sorted by vendor and name (the ones added since the last compaction come last).
+    Array<int> getPlugins(const String& formatName) const {
+        Array<int> ids{};
+        auto format = findFormat(formatName);
+        if (format >= 0)
+            addLiveRecords(ids, range(header(hFormats), format, gFirst), range(header(hFormats), format, gCount));
+        forEachAdded([&](int id, const PluginDescription& desc) {
+            if (desc.pluginFormatName == formatName)
+                ids.add(id);
+        });
+        return ids;
+    }
+
+    Array<int> getPlugins(const String& formatName, const String& vendor) const {
+        Array<int> ids{};
+        auto format = findFormat(formatName);
+        if (format >= 0) {
+            auto vendors = header(hVendors);
+            auto first = range(header(hFormats), format, gFirstVendor);
+            auto count = range(header(hFormats), format, gNumVendors);
+            checkRange(first, count, numVendors);
+            auto end = first + count;
+            auto v = lowerBound(first, end, vendor, [&](uint32 i) { return range(vendors, i, gName); });
+            if (v < end && getString(range(vendors, v, gName)) == vendor)
+                addLiveRecords(ids, range(vendors, v, gFirst), range(vendors, v, gCount));
+        }
+        forEachAdded([&](int id, const PluginDescription& desc) {
+            if (desc.pluginFormatName == formatName && desc.manufacturerName == vendor)
+                ids.add(id);
+        });
+        return ids;
+    }
+
+    // Plugins whose descriptive name starts with the query, case insensitively. An empty format matches all.
+    Array<int> search(const String& query, const String& formatName, int maxResults) const {
+        Array<int> ids{};
+        auto key = query.toLowerCase();
+        auto keyLength = strlen(key.toRawUTF8());
+        auto i = lowerBound(0, numRecords, key, [&](uint32 n) { return field((int) getNameIndexEntry(n), rSearchKey); });
+        for (; i < numRecords && ids.size() < maxResults; i++) {
+            auto id = (int) getNameIndexEntry(i);
+            uint32 length;
+            auto name = getUTF8(field(id, rSearchKey), length);
+            if (length < keyLength || memcmp(name, key.toRawUTF8(), keyLength) != 0)
+                break;
+            if (!isRemoved(id) && (formatName.isEmpty() || getString(field(id, rFormat)) == formatName))
+                ids.add(id);
+        }
+        forEachAdded([&](int id, const PluginDescription& desc) {
+            if (ids.size() < maxResults && (formatName.isEmpty() || desc.pluginFormatName == formatName) &&
+                desc.descriptiveName.toLowerCase().startsWith(key))
+                ids.add(id);
+        });
+        return ids;
+    }
+
+    const StringArray& getBlacklistedFiles() const { return blacklist; }
+
+    // Changes are journaled right away, so that nothing is lost when the app gets killed in the middle of it;
+    // the ones of applyChanges() and importXml() go in one write at the end.
+    void add(const PluginDescription& desc) {
+        JournalBatch batch{*this};
+        remove(desc.createIdentifierString()); // replaces the existing one
+        applyAdd(desc);
+        appendToJournal("+" + desc.createXml()->toString(XmlElement::TextFormat().singleLine().withoutHeader()));
+    }
+
+    void remove(const String& identifier) {
+        JournalBatch batch{*this};
+        auto id = findIdentifier(identifier);
+        if (id >= 0) {
+            applyRemove(id);
+            appendToJournal("-" + String(id) + " " + identifier);
+        }
+    }
+
+    void addToBlacklist(const String& fileOrIdentifier) {
+        JournalBatch batch{*this};
+        if (blacklist.addIfNotAlreadyThere(fileOrIdentifier))
+            appendToJournal("!" + fileOrIdentifier);
+    }
+
+    void removeFromBlacklist(const String& fileOrIdentifier) {
+        JournalBatch batch{*this};
+        if (blacklist.contains(fileOrIdentifier)) {
+            blacklist.removeString(fileOrIdentifier);
+            appendToJournal("~" + fileOrIdentifier);
+        }
+    }
+
+    // The scanner works on a KnownPluginList; these two move its contents in and out.
+    void fillKnownPluginList(KnownPluginList& list) const {
+        list.clear();
+        forEachType([&](int id) { list.addType(getDescription(id)); });
+        for (auto& entry : blacklist)
+            list.addToBlacklist(entry);
+    }
+
+    // Only the differences are journaled, then it compacts if the journal got large.
+    void applyChanges(const KnownPluginList& list) {
+        JournalBatch batch{*this};
+        std::set<String> current{};
+        for (auto& desc : list.getTypes()) {
+            auto identifier = desc.createIdentifierString();
+            current.insert(identifier);
+            auto id = findIdentifier(identifier);
+            if (id < 0 || isChanged(getDescription(id), desc))
+                add(desc);
+        }
+        std::vector<String> vanished{};
+        forEachType([&](int id) {
+            auto identifier = getIdentifier(id);
+            if (current.find(identifier) == current.end())
+                vanished.push_back(identifier);
+        });
+        for (auto& identifier : vanished)
+            remove(identifier);
+
+        auto& listBlacklist = list.getBlacklistedFiles();
+        for (auto& entry : listBlacklist)
+            addToBlacklist(entry);
+        for (auto& entry : StringArray{blacklist})
+            if (!listBlacklist.contains(entry))
+                removeFromBlacklist(entry);
+
+        if (damaged && mapped != nullptr)
+            compact(); // with what could be read, and what the scan found
+        else
+            compactIfNeeded();
+    }
+
+    void compactIfNeeded() {
+        if (journalEntries >= compactThreshold || (numRecords == 0 && !added.empty()))
+            compact();
+    }
+
+    // Writes everything into a new catalog file, and starts over with an empty journal.
+    bool compact() {
+        std::vector<PluginDescription> types{};
+        forEachType([&](int id) { types.push_back(getDescription(id)); });
+        auto entries = blacklist;
+        mapped.reset(); // it cannot be replaced while it is mapped on some platforms.
+        auto ok = write(file, std::move(types), entries);
+        if (ok) {
+            damaged = false;
+            pendingJournal.clear(); // it is all in the file now
+            journalFile.deleteFile();
+        } else
+            flushJournal(); // so that the reload below still gets it
+        load();
+        return ok;
+    }
+
+    // The same format as KnownPluginList::createXml(), for compatibility with other hosts and older versions.
+    std::unique_ptr<XmlElement> createXml() const {
+        auto xml = std::make_unique<XmlElement>("KNOWNPLUGINS");
+        forEachType([&](int id) { xml->addChildElement(getDescription(id).createXml().release()); });
+        for (auto& entry : blacklist)
+            xml->createNewChildElement("BLACKLISTED")->setAttribute("id", entry);
+        return xml;
+    }
+
+    void importXml(const XmlElement& xml) {
+        JournalBatch batch{*this};
+        for (auto child : xml.getChildIterator()) {
+            PluginDescription desc{};
+            if (desc.loadFromXml(*child))
+                add(desc);
+            else if (child->hasTagName("BLACKLISTED"))
+                addToBlacklist(child->getStringAttribute("id"));
+        }
+    }
+
+private:
+    enum HeaderField { hMagic, hVersion, hNumRecords, hNumFormats, hNumVendors, hNumBlacklisted,
+                       hRecords, hFormats, hVendors, hNameIndex, hBlacklist, hStrings, numHeaderFields };
+    enum RecordField { rName, rDescriptiveName, rFormat, rCategory, rManufacturer, rVersion, rFileOrIdentifier,
+                       rIdentifier, rSearchKey, rUniqueId, rDeprecatedUid, rFlags, rNumInputs, rNumOutputs,
+                       rFileModTimeLow, rFileModTimeHigh, rInfoTimeLow, rInfoTimeHigh, numRecordFields };
+    // formats use all of them, vendors only the first three.
+    enum RangeField { gName, gFirst, gCount, gFirstVendor, gNumVendors, numRangeFields };
+    enum Flags : uint32 { flagInstrument = 1, flagSharedContainer = 2, flagARAExtension = 4 };
+
+    File file, journalFile;
+    std::unique_ptr<MemoryMappedFile> mapped{};
+    uint32 numRecords{0}, numFormats{0}, numVendors{0};
+    mutable bool damaged{false}; // the file needs to be rewritten; also set by the reads that find a bad reference
+    bool foundDamaged{false}; // at load, even if it got rewritten since
+
+    // the overlay
+    std::vector<PluginDescription> added{};
+    std::vector<bool> removed{}; // by entry ID
+    StringArray blacklist{};
+    std::map<String, int> identifierIndex{}; // built on demand
+    int journalEntries{0};
+    int journalBatchDepth{0};
+    String pendingJournal{};
+
+    const char* data() const { return (const char*) mapped->getData(); }
+    uint32 word(uint32 offset) const { return ByteOrder::littleEndianInt(data() + offset); }
+    uint32 header(HeaderField f) const { return word((uint32) f * 4); }
+    uint32 field(int id, RecordField f) const { return word(header(hRecords) + ((uint32) id * numRecordFields + f) * 4); }
+    uint32 range(uint32 table, uint32 index, RangeField f) const { return word(table + (index * numRangeFields + f) * 4); }
+    int64 getInt64(int id, RecordField low) const {
+        return (int64) (((uint64) field(id, (RecordField) (low + 1)) << 32) | field(id, low));
+    }
+
+    const char* getUTF8(uint32 ref, uint32& length) const {
+        auto size = (uint64) mapped->getSize();
+        auto offset = (uint64) header(hStrings) + ref;
+        if (offset + 4 <= size) {
+            length = word((uint32) offset);
+            if (offset + 4 + length + 1 <= size && data()[offset + 4 + length] == 0)
+                return data() + offset + 4;
+        }
+        damaged = true;
+        length = 0;
+        return "";
+    }
+
+    // Clamps a range of records or vendors read from the file to what is there.
+    void checkRange(uint32& first, uint32& count, uint32 limit) const {
+        if (first <= limit && count <= limit - first)
+            return;
+        damaged = true;
+        first = jmin(first, limit);
+        count = limit - first;
+    }
+
+    uint32 getNameIndexEntry(uint32 n) const {
+        auto id = word(header(hNameIndex) + n * 4);
+        if (id < numRecords)
+            return id;
+        damaged = true;
+        return 0;
+    }
+
+    String getString(uint32 ref) const {
+        uint32 length;
+        auto utf8 = getUTF8(ref, length);
+        return String::fromUTF8(utf8, (int) length);
+    }
+
+    // Byte order of UTF-8 is code point order, so the file can be searched without decoding anything.
+    static int compareUTF8(const char* a, size_t aLength, const char* b, size_t bLength) {
+        auto c = memcmp(a, b, jmin(aLength, bLength));
+        return c != 0 ? c : (aLength < bLength ? -1 : (aLength > bLength ? 1 : 0));
+    }
+    static int compareUTF8(const String& a, const String& b) {
+        return compareUTF8(a.toRawUTF8(), strlen(a.toRawUTF8()), b.toRawUTF8(), strlen(b.toRawUTF8()));
+    }
+
+    // The first index in [first, end) whose string is not less than the key.
+    template <typename GetRef>
+    uint32 lowerBound(uint32 first, uint32 end, const String& key, GetRef&& getRef) const {
+        auto keyUTF8 = key.toRawUTF8();
+        auto keyLength = strlen(keyUTF8);
+        while (first < end) {
+            auto middle = first + (end - first) / 2;
+            uint32 length;
+            auto s = getUTF8(getRef(middle), length);
+            if (compareUTF8(s, length, keyUTF8, keyLength) < 0)
+                first = middle + 1;
+            else
+                end = middle;
+        }
+        return first;
+    }
+
+    // The header and the extents of the tables only, so that loading does not touch the rest of the file.
+    // What the tables refer to is checked when it is read.
+    bool validate() const {
+        auto size = (uint64) mapped->getSize();
+        if (mapped->getData() == nullptr || size < numHeaderFields * 4 ||
+            header(hMagic) != magic || header(hVersion) != formatVersion)
+            return false;
+        auto fits = [size](uint64 offset, uint64 count, uint64 wordsPerItem) {
+            return offset % 4 == 0 && offset + count * wordsPerItem * 4 <= size;
+        };
+        uint64 records = header(hNumRecords);
+        return fits(header(hRecords), records, numRecordFields) && fits(header(hFormats), header(hNumFormats), numRangeFields) &&
+               fits(header(hVendors), header(hNumVendors), numRangeFields) && fits(header(hNameIndex), records, 1) &&
+               fits(header(hBlacklist), header(hNumBlacklisted), 1) && header(hStrings) <= size;
+    }
+
+    int findFormat(const String& formatName) const {
+        for (uint32 i = 0; i < numFormats; i++)
+            if (getString(range(header(hFormats), i, gName)) == formatName)
+                return (int) i;
+        return -1;
+    }
+
+    bool hasLiveRecord(uint32 first, uint32 count) const {
+        checkRange(first, count, numRecords);
+        for (auto id = first; id < first + count; id++)
+            if (!removed[id])
+                return true;
+        return false;
+    }
+
+    void addLiveRecords(Array<int>& ids, uint32 first, uint32 count) const {
+        checkRange(first, count, numRecords);
+        ids.ensureStorageAllocated(ids.size() + (int) count);
+        for (auto id = first; id < first + count; id++)
+            if (!removed[id])
+                ids.add((int) id);
+    }
+
+    template <typename Func>
+    void forEachAdded(Func&& func) const {
+        for (size_t i = 0; i < added.size(); i++)
+            if (!removed[numRecords + i])
+                func((int) (numRecords + i), added[i]);
+    }
+
+    static bool isChanged(const PluginDescription& a, const PluginDescription& b) {
+        return a.lastFileModTime != b.lastFileModTime || a.lastInfoUpdateTime != b.lastInfoUpdateTime ||
+               a.version != b.version || a.descriptiveName != b.descriptiveName || a.manufacturerName != b.manufacturerName;
+    }
+
+    // Neither of them builds the identifier index, so that replaying the journal does not read every record.
+    void applyAdd(const PluginDescription& desc) {
+        added.push_back(desc);
+        removed.push_back(false);
+        if (!identifierIndex.empty())
+            identifierIndex[desc.createIdentifierString()] = getNumEntries() - 1;
+    }
+
+    void applyRemove(int id) {
+        if (id < 0 || id >= getNumEntries() || removed[(size_t) id])
+            return;
+        removed[(size_t) id] = true;
+        if (!identifierIndex.empty())
+            identifierIndex.erase(getIdentifier(id));
+    }
+
+    // Journal lines are buffered until the outermost change is done, so that a scan of thousands of plugins
+    // opens the journal once instead of once per plugin.
+    class JournalBatch {
+        PluginCatalog& catalog;
+
+    public:
+        explicit JournalBatch(PluginCatalog& catalog) : catalog(catalog) { catalog.journalBatchDepth++; }
+        ~JournalBatch() {
+            if (--catalog.journalBatchDepth == 0)
+                catalog.flushJournal();
+        }
+    };
+
+    void appendToJournal(const String& line) {
+        pendingJournal << line << "\n";
+        journalEntries++;
+    }
+
+    void flushJournal() {
+        if (pendingJournal.isEmpty())
+            return;
+        FileOutputStream out{journalFile};
+        if (out.openedOk()) {
+            out << pendingJournal;
+            out.flush();
+        }
+        pendingJournal.clear();
+    }
+
+    void replayJournal() {
+        StringArray lines{};
+        journalFile.readLines(lines);
+        for (auto& line : lines) {
+            if (line.isEmpty())
+                continue;
+            auto value = line.substring(1);
+            switch (line[0]) {
+                case '+':
+                    if (auto xml = parseXML(value)) {
+                        PluginDescription desc{};
+                        if (desc.loadFromXml(*xml))
+                            applyAdd(desc);
+                    }
+                    break;
+                case '-':
+                    // the IDs are those of the file the journal was written for, which is gone if it was damaged.
+                    if (mapped != nullptr)
+                        applyRemove(value.getIntValue());
+                    else
+                        applyRemove(findIdentifier(value.fromFirstOccurrenceOf(" ", false, false)));
+                    break;
+                case '!':
+                    blacklist.addIfNotAlreadyThere(value);
+                    break;
+                case '~':
+                    blacklist.removeString(value);
+                    break;
+                default:
+                    break;
+            }
+            journalEntries++;
+        }
+    }
+
+    class StringPool {
+        MemoryOutputStream data{};
+        std::map<String, uint32> offsets{};
+
+    public:
+        StringPool() { add({}); } // so that 0 is the empty string
+
+        uint32 add(const String& s) {
+            auto it = offsets.find(s);
+            if (it != offsets.end())
+                return it->second;
+            auto offset = (uint32) data.getDataSize();
+            auto utf8 = s.toRawUTF8();
+            auto length = strlen(utf8);
+            data.writeInt((int) length);
+            data.write(utf8, length + 1);
+            offsets[s] = offset;
+            return offset;
+        }
+
+        const MemoryOutputStream& getData() const { return data; }
+    };
+
+    static bool write(const File& target, std::vector<PluginDescription> types, const StringArray& blacklist) {
+        struct Item {
+            PluginDescription desc;
+            String searchKey;
+        };
+        std::vector<Item> items{};
+        for (auto& desc : types)
+            items.push_back({desc, desc.descriptiveName.toLowerCase()});
+        std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+            if (auto c = compareUTF8(a.desc.pluginFormatName, b.desc.pluginFormatName))
+                return c < 0;
+            if (auto c = compareUTF8(a.desc.manufacturerName, b.desc.manufacturerName))
+                return c < 0;
+            return compareUTF8(a.searchKey, b.searchKey) < 0;
+        });
+
+        StringPool strings{};
+        std::vector<uint32> records{}, formats{}, vendors{}, names{}, blacklisted{};
+        for (uint32 i = 0; i < (uint32) items.size(); i++) {
+            auto& desc = items[i].desc;
+            auto fileModTime = (uint64) desc.lastFileModTime.toMilliseconds();
+            auto infoTime = (uint64) desc.lastInfoUpdateTime.toMilliseconds();
+            uint32 fields[numRecordFields] = {
+                strings.add(desc.name), strings.add(desc.descriptiveName), strings.add(desc.pluginFormatName),
+                strings.add(desc.category), strings.add(desc.manufacturerName), strings.add(desc.version),
+                strings.add(desc.fileOrIdentifier), strings.add(desc.createIdentifierString()), strings.add(items[i].searchKey),
+                (uint32) desc.uniqueId, (uint32) desc.deprecatedUid,
+                (desc.isInstrument ? flagInstrument : 0u) | (desc.hasSharedContainer ? flagSharedContainer : 0u) |
+                    (desc.hasARAExtension ? flagARAExtension : 0u),
+                (uint32) desc.numInputChannels, (uint32) desc.numOutputChannels,
+                (uint32) fileModTime, (uint32) (fileModTime >> 32), (uint32) infoTime, (uint32) (infoTime >> 32)
+            };
+            records.insert(records.end(), std::begin(fields), std::end(fields));
+
+            bool newFormat = i == 0 || desc.pluginFormatName != items[i - 1].desc.pluginFormatName;
+            if (newFormat)
+                formats.insert(formats.end(), { strings.add(desc.pluginFormatName), i, 0, (uint32) vendors.size() / numRangeFields, 0 });
+            if (newFormat || desc.manufacturerName != items[i - 1].desc.manufacturerName) {
+                vendors.insert(vendors.end(), { strings.add(desc.manufacturerName), i, 0, 0, 0 });
+                formats[formats.size() - numRangeFields + gNumVendors]++;
+            }
+            formats[formats.size() - numRangeFields + gCount]++;
+            vendors[vendors.size() - numRangeFields + gCount]++;
+            names.push_back(i);
+        }
+        std::sort(names.begin(), names.end(), [&](uint32 a, uint32 b) {
+            auto c = compareUTF8(items[a].searchKey, items[b].searchKey);
+            return c != 0 ? c < 0 : a < b;
+        });
+        for (auto& entry : blacklist)
+            blacklisted.push_back(strings.add(entry));
+
+        uint32 offset = numHeaderFields * 4;
+        auto place = [&](const std::vector<uint32>& words) {
+            auto start = offset;
+            offset += (uint32) words.size() * 4;
+            return start;
+        };
+        uint32 head[numHeaderFields] = {};
+        head[hMagic] = magic;
+        head[hVersion] = formatVersion;
+        head[hNumRecords] = (uint32) items.size();
+        head[hNumFormats] = (uint32) formats.size() / numRangeFields;
+        head[hNumVendors] = (uint32) vendors.size() / numRangeFields;
+        head[hNumBlacklisted] = (uint32) blacklisted.size();
+        head[hRecords] = place(records);
+        head[hFormats] = place(formats);
+        head[hVendors] = place(vendors);
+        head[hNameIndex] = place(names);
+        head[hBlacklist] = place(blacklisted);
+        head[hStrings] = offset;
+
+        MemoryOutputStream out{};
+        for (auto w : head)
+            out.writeInt((int) w);
+        for (auto table : { &records, &formats, &vendors, &names, &blacklisted })
+            for (auto w : *table)
+                out.writeInt((int) w);
+        out.write(strings.getData().getData(), strings.getData().getDataSize());
+
+        TemporaryFile temp{target};
+        return temp.getFile().replaceWithData(out.getData(), out.getDataSize()) && temp.overwriteTargetFileWithTemporary();
+    }
+};
+
+#endif //ANDROIDPLUGINHOST_CATALOG_H
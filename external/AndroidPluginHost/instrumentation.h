@@ -0,0 +1,398 @@
+#ifndef ANDROIDPLUGINHOST_INSTRUMENTATION_H
+#define ANDROIDPLUGINHOST_INSTRUMENTATION_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <juce_audio_processors/juce_audio_processors.h>
+#include <juce_audio_devices/juce_audio_devices.h>
+
+using namespace juce;
+
+struct DspLoadRecord {
+    int64 startTicks{0};
+    int64 elapsedTicks{0};
+    int64 budgetTicks{0}; // the duration of the block, i.e. the deadline
+};
+
+// Single producer (the audio thread), single consumer (the message thread). Records are dropped when full.
+class DspLoadRing {
+    static constexpr int capacity = 1024;
+    AbstractFifo fifo{capacity};
+    std::array<DspLoadRecord, capacity> records{};
+    std::atomic<int> numDropped{0};
+
+public:
+    void push(const DspLoadRecord& record) {
+        if (fifo.getFreeSpace() == 0) {
+            ++numDropped;
+            return;
+        }
+        fifo.write(1).forEach([&](int index) { records[(size_t) index] = record; });
+    }
+
+    template <typename Func>
+    void drain(Func&& func) {
+        fifo.read(fifo.getNumReady()).forEach([&](int index) { func(records[(size_t) index]); });
+    }
+
+    int getNumDropped() const { return numDropped; }
+};
+
+// Forwards everything to the hosted instance, measuring how long each processBlock() takes.
+// It can also hold a standby instance of the same plugin to switch to without a click (see PresetCache).
+class InstrumentedProcessor : public AudioProcessor {
+    // instances[live] is processed; the other one, if any, is a standby that can be prepared on the message
+    // thread (e.g. with another preset) and then crossfaded in by the audio thread.
+    std::unique_ptr<AudioPluginInstance> instances[2];
+    std::atomic<int> live{0};
+    DspLoadRing ring{};
+    double ticksPerSample{0};
+    double preparedSampleRate{0};
+    int preparedBlockSize{0};
+
+    enum SwapState { swapIdle, swapPending };
+    std::atomic<int> swapState{swapIdle};
+    // audio thread only
+    AudioBuffer<float> fadeBuffer{};
+    MidiBuffer fadeMidiBuffer{};
+    int fadeLength{0};
+    int fadePosition{0};
+    // the velocity of the notes held on the live instance per channel (0 if not held), so that a swap can carry them over.
+    uint8 heldNotes[16][128]{};
+    // the notes replayed into the incoming instance in this block, which are not passed downstream again.
+    bool replayedNotes[16][128]{};
+
+    void trackHeldNotes(const MidiBuffer& midiBuffer) {
+        for (const auto metadata : midiBuffer) {
+            if (metadata.numBytes < 3)
+                continue;
+            auto status = metadata.data[0] & 0xF0;
+            auto channel = metadata.data[0] & 0x0F;
+            auto note = metadata.data[1] & 0x7F;
+            if (status == 0x90 && metadata.data[2] != 0)
+                heldNotes[channel][note] = metadata.data[2];
+            else if (status == 0x80 || status == 0x90)
+                heldNotes[channel][note] = 0;
+            else if (status == 0xB0 && (metadata.data[1] == 120 || metadata.data[1] == 123)) // all sound / notes off
+                std::fill(std::begin(heldNotes[channel]), std::end(heldNotes[channel]), 0);
+        }
+    }
+
+    // note-ons (for the incoming instance) or note-offs and all notes off (for the outgoing one) of every held note.
+    void addHeldNotes(MidiBuffer& midiBuffer, bool noteOn, int samplePosition) {
+        for (int channel = 0; channel < 16; channel++) {
+            bool held = false;
+            for (int note = 0; note < 128; note++)
+                if (auto velocity = heldNotes[channel][note]) {
+                    uint8 bytes[3]{(uint8) ((noteOn ? 0x90 : 0x80) | channel), (uint8) note, noteOn ? velocity : (uint8) 0};
+                    midiBuffer.addEvent(bytes, 3, samplePosition);
+                    if (noteOn)
+                        replayedNotes[channel][note] = true;
+                    held = true;
+                }
+            if (held && !noteOn) {
+                uint8 allNotesOff[3]{(uint8) (0xB0 | channel), 123, 0};
+                midiBuffer.addEvent(allNotesOff, 3, samplePosition);
+            }
+        }
+    }
+
+    static BusesProperties getBusesProperties(AudioProcessor& processor) {
+        BusesProperties props{};
+        for (auto isInput : { true, false })
+            for (int i = 0, n = processor.getBusCount(isInput); i < n; i++) {
+                auto bus = processor.getBus(isInput, i);
+                props.addBus(isInput, bus->getName(), bus->getLastEnabledLayout(), bus->isEnabledByDefault());
+            }
+        return props;
+    }
+
+    AudioPluginInstance* getLive() const { return instances[live.load()].get(); }
+
+    void prepareInstance(AudioPluginInstance& instance) {
+        instance.setRateAndBufferSizeDetails(preparedSampleRate, preparedBlockSize);
+        instance.prepareToPlay(preparedSampleRate, preparedBlockSize);
+    }
+
+    // audio thread. Both instances get the same input; the output ramps from the live one to the standby.
+    // The standby starts with the notes that were held on the live one, which releases all of them at the end.
+    void processCrossfade(AudioPluginInstance& current, AudioPluginInstance& next, AudioBuffer<float>& buffer, MidiBuffer& midiBuffer) {
+        auto numSamples = buffer.getNumSamples();
+        auto n = jmin(numSamples, fadeLength - fadePosition);
+        fadeBuffer.makeCopyOf(buffer, true);
+        fadeMidiBuffer.clear();
+        bool replayed = fadePosition == 0;
+        if (replayed)
+            addHeldNotes(fadeMidiBuffer, true, 0);
+        fadeMidiBuffer.addEvents(midiBuffer, 0, -1, 0);
+        trackHeldNotes(midiBuffer);
+        if (fadePosition + n >= fadeLength)
+            addHeldNotes(midiBuffer, false, numSamples - 1);
+        current.processBlock(buffer, midiBuffer);
+        next.processBlock(fadeBuffer, fadeMidiBuffer);
+
+        auto gainStart = (float) fadePosition / (float) fadeLength;
+        auto gainEnd = (float) (fadePosition + n) / (float) fadeLength;
+        for (int ch = 0; ch < buffer.getNumChannels(); ch++) {
+            buffer.applyGainRamp(ch, 0, n, 1.0f - gainStart, 1.0f - gainEnd);
+            buffer.addFromWithRamp(ch, 0, fadeBuffer.getReadPointer(ch), n, gainStart, gainEnd);
+            if (n < numSamples)
+                buffer.copyFrom(ch, n, fadeBuffer, ch, n, numSamples - n);
+        }
+        // MIDI output cannot be mixed, so it comes from the incoming instance from the beginning. Downstream has
+        // seen the replayed notes start already, so if the instance passes them through, they are dropped.
+        midiBuffer.clear();
+        for (const auto metadata : fadeMidiBuffer) {
+            if (replayed && metadata.samplePosition == 0 && metadata.numBytes == 3 && (metadata.data[0] & 0xF0) == 0x90) {
+                auto& wasReplayed = replayedNotes[metadata.data[0] & 0x0F][metadata.data[1] & 0x7F];
+                if (wasReplayed) {
+                    wasReplayed = false;
+                    continue;
+                }
+            }
+            midiBuffer.addEvent(metadata.data, metadata.numBytes, metadata.samplePosition);
+        }
+        if (replayed)
+            std::fill(&replayedNotes[0][0], &replayedNotes[0][0] + 16 * 128, false);
+
+        fadePosition += n;
+        if (fadePosition >= fadeLength) {
+            fadePosition = 0;
+            live = 1 - live;
+            swapState.store(swapIdle);
+        }
+    }
+
+public:
+    explicit InstrumentedProcessor(std::unique_ptr<AudioPluginInstance> pluginInstance)
+    : AudioProcessor(getBusesProperties(*pluginInstance)) {
+        instances[0] = std::move(pluginInstance);
+        setBusesLayout(instances[0]->getBusesLayout());
+    }
+
+    // Use this for anything specific to the plugin, e.g. its editor.
+    AudioPluginInstance* getInstance() { return getLive(); }
+    DspLoadRing& getDspLoadRing() { return ring; }
+
+    // message thread. Another instance of the same plugin, prepared like the live one.
+    void setStandbyInstance(std::unique_ptr<AudioPluginInstance> instance) {
+        jassert(!isSwapping());
+        instance->setBusesLayout(getBusesLayout());
+        if (preparedSampleRate > 0)
+            prepareInstance(*instance);
+        instances[1 - live] = std::move(instance);
+    }
+
+    // message thread. nullptr while it is being swapped in, as the audio thread processes it then.
+    AudioPluginInstance* getStandbyInstance() {
+        return isSwapping() ? nullptr : instances[1 - live].get();
+    }
+    bool hasStandbyInstance() { return instances[1 - live] != nullptr; }
+    bool isSwapping() const { return swapState.load() != swapIdle; }
+
+    // message thread. Crossfades to the standby instance within the next few blocks; the live one becomes the standby.
+    void swapToStandbyInstance() {
+        if (hasStandbyInstance())
+            swapState.store(swapPending);
+    }
+
+    void prepareToPlay(double sampleRate, int samplesPerBlock) override {
+        ticksPerSample = (double) Time::getHighResolutionTicksPerSecond() / sampleRate;
+        preparedSampleRate = sampleRate;
+        preparedBlockSize = samplesPerBlock;
+        for (auto& instance : instances)
+            if (instance != nullptr)
+                prepareInstance(*instance);
+        setLatencySamples(getLive()->getLatencySamples());
+        fadeLength = jmax(1, roundToInt(sampleRate * 0.01));
+        fadePosition = 0;
+        std::fill(&heldNotes[0][0], &heldNotes[0][0] + 16 * 128, 0);
+        fadeBuffer.setSize(jmax(getTotalNumInputChannels(), getTotalNumOutputChannels()), samplesPerBlock);
+        fadeMidiBuffer.ensureSize(4096);
+    }
+    void releaseResources() override {
+        for (auto& instance : instances)
+            if (instance != nullptr)
+                instance->releaseResources();
+        preparedSampleRate = 0;
+    }
+    void reset() override { getLive()->reset(); }
+    void setNonRealtime(bool isNonRealtime) noexcept override {
+        AudioProcessor::setNonRealtime(isNonRealtime);
+        for (auto& instance : instances)
+            if (instance != nullptr)
+                instance->setNonRealtime(isNonRealtime);
+    }
+
+    void processBlock(AudioBuffer<float>& buffer, MidiBuffer& midiBuffer) override {
+        auto start = Time::getHighResolutionTicks();
+        auto& current = *instances[live];
+        if (current.getPlayHead() != getPlayHead())
+            current.setPlayHead(getPlayHead());
+        if (swapState.load() == swapPending) {
+            auto& next = *instances[1 - live];
+            if (next.getPlayHead() != getPlayHead())
+                next.setPlayHead(getPlayHead());
+            processCrossfade(current, next, buffer, midiBuffer);
+        } else {
+            trackHeldNotes(midiBuffer);
+            current.processBlock(buffer, midiBuffer);
+        }
+        ring.push({start, Time::getHighResolutionTicks() - start, (int64) (buffer.getNumSamples() * ticksPerSample)});
+    }
+
+    bool isBusesLayoutSupported(const BusesLayout& layouts) const override { return getLive()->checkBusesLayoutSupported(layouts); }
+    void processorLayoutsChanged() override {
+        for (auto& instance : instances)
+            if (instance != nullptr)
+                instance->setBusesLayout(getBusesLayout());
+    }
+
+    AudioProcessorEditor* createEditor() override { return nullptr; }
+    bool hasEditor() const override { return false; }
+    const String getName() const override { return getLive()->getName(); }
+    void getStateInformation(juce::MemoryBlock& destData) override { getLive()->getStateInformation(destData); }
+    void setStateInformation(const void* data, int sizeInBytes) override { getLive()->setStateInformation(data, sizeInBytes); }
+    double getTailLengthSeconds() const override { return getLive()->getTailLengthSeconds(); }
+    bool acceptsMidi() const override { return getLive()->acceptsMidi(); }
+    bool producesMidi() const override { return getLive()->producesMidi(); }
+    bool isMidiEffect() const override { return getLive()->isMidiEffect(); }
+    int getNumPrograms() override { return getLive()->getNumPrograms(); }
+    int getCurrentProgram() override { return getLive()->getCurrentProgram(); }
+    void setCurrentProgram(int index) override { getLive()->setCurrentProgram(index); }
+    const String getProgramName(int index) override { return getLive()->getProgramName(index); }
+    void changeProgramName(int index, const String &newName) override { getLive()->changeProgramName(index, newName); }
+};
+
+// Sits between the device and the AudioProcessorPlayer to measure the whole graph.
+class InstrumentedAudioCallback : public AudioIODeviceCallback {
+    AudioIODeviceCallback& target;
+    DspLoadRing ring{};
+    double ticksPerSample{0};
+    std::atomic<bool> marked{false};
+    std::atomic<int64> markedCallbackTicks{0};
+
+public:
+    explicit InstrumentedAudioCallback(AudioIODeviceCallback& target) : target(target) {}
+
+    DspLoadRing& getDspLoadRing() { return ring; }
+
+    // The end of the first callback after this call is available from getMarkedCallbackTicks() (0 until then).
+    void markNextCallback() {
+        markedCallbackTicks = 0;
+        marked = true;
+    }
+    int64 getMarkedCallbackTicks() const { return markedCallbackTicks; }
+
+    void audioDeviceIOCallbackWithContext(const float* const* inputChannelData, int numInputChannels,
+                                          float* const* outputChannelData, int numOutputChannels,
+                                          int numSamples, const AudioIODeviceCallbackContext& context) override {
+        auto start = Time::getHighResolutionTicks();
+        target.audioDeviceIOCallbackWithContext(inputChannelData, numInputChannels,
+                                                outputChannelData, numOutputChannels, numSamples, context);
+        auto end = Time::getHighResolutionTicks();
+        ring.push({start, end - start, (int64) (numSamples * ticksPerSample)});
+        if (marked.load(std::memory_order_relaxed)) {
+            marked = false;
+            markedCallbackTicks = end;
+        }
+    }
+
+    void audioDeviceAboutToStart(AudioIODevice* device) override {
+        ticksPerSample = (double) Time::getHighResolutionTicksPerSecond() / device->getCurrentSampleRate();
+        target.audioDeviceAboutToStart(device);
+    }
+    void audioDeviceStopped() override { target.audioDeviceStopped(); }
+    void audioDeviceError(const String& errorMessage) override { target.audioDeviceError(errorMessage); }
+};
+
+// Drains the rings on the message thread and aggregates them per source. Optionally writes every record as CSV.
+class DspLoadMonitor : private Timer {
+public:
+    static constexpr int wholeGraphSourceId = 0;
+
+    struct Stats {
+        String name{};
+        double load{0};          // the ratio to the deadline within the last refresh interval
+        double worstSeconds{0};
+        int deadlineMisses{0};
+        int dropped{0};
+    };
+
+    std::function<void()> onUpdate{};
+    std::function<int()> getXRunCount{};
+
+    DspLoadMonitor() { startTimerHz(10); }
+    ~DspLoadMonitor() override { stopTimer(); }
+
+    void addSource(int id, const String& name, DspLoadRing* ring) {
+        sources[id] = Source{ring, Stats{name}};
+    }
+    void removeSource(int id) { sources.erase(id); }
+
+    void forEachStats(const std::function<void(int id, const Stats&)>& func) {
+        for (auto& source : sources)
+            func(source.first, source.second.stats);
+    }
+    int getXRuns() { return getXRunCount ? getXRunCount() : -1; }
+
+    void resetWorst() {
+        for (auto& source : sources) {
+            source.second.stats.worstSeconds = 0;
+            source.second.stats.deadlineMisses = 0;
+        }
+    }
+
+    bool startTrace(const File& file) {
+        stopTrace();
+        file.deleteFile();
+        trace = file.createOutputStream();
+        if (trace == nullptr)
+            return false;
+        traceStartTicks = Time::getHighResolutionTicks();
+        *trace << "source,name,start_seconds,elapsed_us,budget_us\n";
+        return true;
+    }
+    void stopTrace() {
+        if (trace != nullptr)
+            trace->flush();
+        trace.reset();
+    }
+
+private:
+    struct Source {
+        DspLoadRing* ring{nullptr};
+        Stats stats{};
+    };
+    std::map<int, Source> sources{};
+    std::unique_ptr<FileOutputStream> trace{};
+    int64 traceStartTicks{0};
+
+    void timerCallback() override {
+        for (auto& source : sources) {
+            auto& stats = source.second.stats;
+            int64 elapsed = 0, budget = 0;
+            source.second.ring->drain([&](const DspLoadRecord& record) {
+                elapsed += record.elapsedTicks;
+                budget += record.budgetTicks;
+                stats.worstSeconds = jmax(stats.worstSeconds, Time::highResolutionTicksToSeconds(record.elapsedTicks));
+                if (record.elapsedTicks > record.budgetTicks)
+                    stats.deadlineMisses++;
+                if (trace != nullptr)
+                    *trace << source.first << "," << stats.name.quoted() << ","
+                           << String(Time::highResolutionTicksToSeconds(record.startTicks - traceStartTicks), 6) << ","
+                           << String(Time::highResolutionTicksToSeconds(record.elapsedTicks) * 1e6, 1) << ","
+                           << String(Time::highResolutionTicksToSeconds(record.budgetTicks) * 1e6, 1) << "\n";
+            });
+            stats.load = budget > 0 ? (double) elapsed / (double) budget : 0;
+            stats.dropped = source.second.ring->getNumDropped();
+        }
+        if (onUpdate)
+            onUpdate();
+    }
+};
+
+#endif //ANDROIDPLUGINHOST_INSTRUMENTATION_H
@@ -0,0 +1,412 @@
+#ifndef ANDROIDPLUGINHOST_LANES_H
+#define ANDROIDPLUGINHOST_LANES_H
+
+#include <atomic>
+#include <semaphore>
+#include <set>
+#include <thread>
+#include <juce_audio_processors/juce_audio_processors.h>
+#include "topology.h"
+
+using namespace juce;
+
+// An independent plugin chain (e.g. a layered instrument, or one side of a split keyboard) in its own graph.
+// It receives a copy of the main chain's input and its output is summed into the main chain at the join point.
+class Lane {
+    AudioProcessorGraph graph{};
+    AudioProcessorGraph::Node::Ptr audioInputNode{nullptr}, audioOutputNode{nullptr}, midiInputNode{nullptr};
+    std::set<AudioProcessorGraph::NodeID> configuredNodes{};
+    std::atomic<int> lowestNote{0}, highestNote{127};
+    MidiBuffer deferredMidi{}; // audio thread only, see defer()
+
+    // audio thread
+    void addInRange(MidiBuffer& target, const MidiBuffer& midi, bool atStart) {
+        int lowest = lowestNote, highest = highestNote;
+        for (const auto metadata : midi) {
+            auto status = metadata.data[0] & 0xF0;
+            auto isNoteOn = status == 0x90 && metadata.numBytes > 2 && metadata.data[2] != 0;
+            if ((isNoteOn || status == 0xA0) && metadata.numBytes > 1 &&
+                (metadata.data[1] < lowest || metadata.data[1] > highest))
+                continue;
+            target.addEvent(metadata.data, metadata.numBytes, atStart ? 0 : metadata.samplePosition);
+        }
+    }
+
+public:
+    // accessed by the audio thread and the lane workers only
+    AudioBuffer<float> buffer{};
+    MidiBuffer midiBuffer{};
+
+    std::atomic<bool> active{false};
+    // set by the audio thread when the lane is scheduled, cleared by whoever finished processing it.
+    std::atomic<bool> running{false};
+
+    Lane() {
+        // the IO nodes take their channel counts from the graph, so it has to be configured before they are added.
+        graph.setPlayConfigDetails(2, 2, 44100, 512);
+        audioInputNode = graph.addNode(std::make_unique<AudioProcessorGraph::AudioGraphIOProcessor>(AudioProcessorGraph::AudioGraphIOProcessor::audioInputNode));
+        audioOutputNode = graph.addNode(std::make_unique<AudioProcessorGraph::AudioGraphIOProcessor>(AudioProcessorGraph::AudioGraphIOProcessor::audioOutputNode));
+        midiInputNode = graph.addNode(std::make_unique<AudioProcessorGraph::AudioGraphIOProcessor>(AudioProcessorGraph::AudioGraphIOProcessor::midiInputNode));
+        graph.enableAllBuses();
+    }
+
+    AudioProcessorGraph& getGraph() { return graph; }
+
+    // Only the notes in the range start in this lane, e.g. for one side of a split keyboard. Note-offs always
+    // pass, so that changing the range does not leave notes hanging.
+    void setNoteRange(int lowest, int highest) {
+        lowestNote = jlimit(0, 127, lowest);
+        highestNote = jlimit(lowestNote.load(), 127, highest);
+    }
+    Range<int> getNoteRange() const { return {lowestNote.load(), highestNote.load()}; }
+
+    bool contains(AudioProcessorGraph::Node::Ptr node) { return graph.getNodeForId(node->nodeID) == node.get(); }
+
+    Array<AudioProcessorGraph::Node::Ptr> getPlugins() {
+        Array<AudioProcessorGraph::Node::Ptr> ret{};
+        for (auto node : graph.getNodes())
+            if (node->nodeID != audioInputNode->nodeID && node->nodeID != audioOutputNode->nodeID && node->nodeID != midiInputNode->nodeID)
+                ret.add(node);
+        return ret;
+    }
+
+    // Without updateTopology, the plugin is not connected until updateGraph() is called.
+    AudioProcessorGraph::Node::Ptr addPlugin(std::unique_ptr<AudioProcessor> processor, bool updateTopology = true) {
+        auto node = graph.addNode(std::move(processor), std::nullopt, AudioProcessorGraph::UpdateKind::async);
+        node->getProcessor()->setPlayConfigDetails(2, 2, graph.getSampleRate(), graph.getBlockSize());
+        node->getProcessor()->setNonRealtime(graph.isNonRealtime());
+        node->getProcessor()->enableAllBuses();
+        if (updateTopology)
+            updateGraph();
+        active = true;
+        return node;
+    }
+
+    void removePlugin(AudioProcessorGraph::Node::Ptr node) {
+        graph.removeNode(node->nodeID, AudioProcessorGraph::UpdateKind::async);
+        updateGraph();
+        active = !getPlugins().isEmpty();
+    }
+
+    void prepare(double sampleRate, int samplesPerBlock) {
+        graph.setPlayConfigDetails(2, 2, sampleRate, samplesPerBlock);
+        graph.prepareToPlay(sampleRate, samplesPerBlock);
+        buffer.setSize(2, samplesPerBlock);
+        midiBuffer.ensureSize(4096);
+        deferredMidi.clear();
+        deferredMidi.ensureSize(4096);
+    }
+
+    void release() { graph.releaseResources(); }
+
+    // audio thread
+    void load(const AudioBuffer<float>& input, const MidiBuffer& midi) {
+        auto numSamples = input.getNumSamples();
+        buffer.setSize(2, numSamples, false, false, true);
+        for (int ch = 0; ch < 2; ch++)
+            if (ch < input.getNumChannels())
+                buffer.copyFrom(ch, 0, input, ch, 0, numSamples);
+            else
+                buffer.clear(ch, 0, numSamples);
+
+        midiBuffer.clear();
+        midiBuffer.addEvents(deferredMidi, 0, -1, 0);
+        deferredMidi.clear();
+        addInRange(midiBuffer, midi, false);
+    }
+
+    // audio thread. The lane is still busy with an earlier block, so the events of this one go to the start of
+    // the next block it gets. Its audio input for the block is lost either way, but a lost note-off would hang.
+    void defer(const MidiBuffer& midi) { addInRange(deferredMidi, midi, true); }
+
+    // audio thread or a lane worker
+    void process() { graph.processBlock(buffer, midiBuffer); }
+
+    void updateGraph() {
+        DesiredConnections desired{graph};
+        auto prev = audioInputNode;
+        auto plugins = getPlugins();
+        for (auto node : plugins) {
+            desired.addAudio(prev->nodeID, node->nodeID);
+            prev = node;
+        }
+        desired.addAudio(prev->nodeID, audioOutputNode->nodeID);
+
+        prev = midiInputNode;
+        for (auto node : plugins) {
+            if (node->getProcessor()->acceptsMidi())
+                desired.addMidi(prev->nodeID, node->nodeID);
+            if (node->getProcessor()->producesMidi())
+                prev = node;
+        }
+        TopologyChange::compute(graph, desired.get()).applyTo(graph);
+    }
+};
+
+// Runs the lanes between LaneForkProcessor and LaneJoinProcessor. At the fork, the lanes are published as jobs
+// that the workers claim lock-free; the audio thread keeps processing the main chain meanwhile, and at the join
+// it claims whatever is left itself before spinning for the jobs still running elsewhere.
+// Workers spin for a bounded time after each block before going to sleep, so that a steady stream of blocks
+// does not cost a wakeup each time. Waking one up is a semaphore post (a futex wake where available), which
+// takes no lock on the audio thread.
+// A lane that a stalled worker has not finished by the end of the block is left out of the mix, and of the
+// following blocks until the worker is done with it, instead of holding up the audio callback. The MIDI of the
+// blocks it misses is delivered once it is back. Offline (non-realtime) there is no deadline: the join waits
+// for every lane, so that renders are deterministic and compare fairly with serial processing.
+class LaneScheduler {
+public:
+    static constexpr int maxLanes = 8; // including the main chain (lane 0), which is not managed here.
+
+    LaneScheduler() {
+        for (int i = 1; i < maxLanes; i++)
+            lanes.add(new Lane());
+        auto numWorkers = jmin(maxLanes - 1, SystemStats::getNumCpuCores() - 1);
+        for (int i = 0; i < numWorkers; i++)
+            workers.add(new Worker(*this));
+    }
+
+    ~LaneScheduler() {
+        for (auto worker : workers) {
+            worker->signalThreadShouldExit();
+            worker->wake();
+        }
+        for (auto worker : workers)
+            worker->stopThread(1000);
+    }
+
+    // index is 1-based, as 0 is the main chain.
+    Lane* getLane(int index) { return lanes[index - 1]; }
+    int getNumWorkers() const { return workers.size(); }
+
+    // Without parallel processing all the lanes run on the audio thread, which is what the graph used to do.
+    void setParallelProcessingEnabled(bool enabled) { parallel = enabled; }
+    bool isParallelProcessingEnabled() const { return parallel; }
+
+    void setNonRealtime(bool isNonRealtime) {
+        nonRealtime = isNonRealtime;
+        for (auto lane : lanes)
+            lane->getGraph().setNonRealtime(isNonRealtime);
+    }
+
+    void prepare(double sampleRate, int samplesPerBlock) {
+        ticksPerSample = (double) Time::getHighResolutionTicksPerSecond() / sampleRate;
+        for (auto lane : lanes)
+            lane->prepare(sampleRate, samplesPerBlock);
+        for (auto worker : workers)
+            if (!worker->isThreadRunning() && !worker->startRealtimeThread(Thread::RealtimeOptions{}))
+                worker->startThread(Thread::Priority::highest);
+    }
+
+    void release() {
+        for (auto lane : lanes)
+            lane->release();
+    }
+
+    // audio thread
+    void fork(const AudioBuffer<float>& input, const MidiBuffer& midi) {
+        int n = 0;
+        for (int i = 0; i < lanes.size(); i++) {
+            auto lane = lanes.getUnchecked(i);
+            if (!lane->active)
+                continue;
+            // a lane that is still running is held by a stalled worker, which may still write into its buffers.
+            if (lane->running.load(std::memory_order_acquire)) {
+                lane->defer(midi);
+                continue;
+            }
+            lane->load(input, midi);
+            lane->running.store(true, std::memory_order_relaxed);
+            scheduled[n++].store(i, std::memory_order_relaxed);
+        }
+        numScheduled = n;
+        deadlineTicks = Time::getHighResolutionTicks() + (int64) (input.getNumSamples() * ticksPerSample);
+        published = n > 0 && parallel && !workers.isEmpty();
+        if (!published)
+            return;
+
+        generation = (generation + 1) & 0xFFFF;
+        jobs.store(packJobs(generation, (uint32) n, 0));
+        for (auto worker : workers)
+            worker->wake();
+    }
+
+    // audio thread
+    void join(AudioBuffer<float>& output) {
+        if (numScheduled == 0)
+            return;
+        if (published) {
+            for (int lane; (lane = claimJob()) >= 0;)
+                runJob(lane);
+            for (int spins = 0; !areScheduledLanesFinished(); spins++) {
+                if (spins <= 1000)
+                    continue;
+                if (!nonRealtime && Time::getHighResolutionTicks() > deadlineTicks)
+                    break;
+                std::this_thread::yield();
+            }
+        } else {
+            for (int i = 0; i < numScheduled; i++)
+                runJob(scheduled[i].load(std::memory_order_relaxed));
+        }
+
+        auto numSamples = output.getNumSamples();
+        for (int i = 0; i < numScheduled; i++) {
+            auto lane = lanes.getUnchecked(scheduled[i].load(std::memory_order_relaxed));
+            if (lane->running.load(std::memory_order_acquire))
+                continue; // past the deadline
+            for (int ch = 0; ch < jmin(2, output.getNumChannels()); ch++)
+                output.addFrom(ch, 0, lane->buffer, ch, 0, numSamples);
+        }
+    }
+
+private:
+    class Worker : public Thread {
+        LaneScheduler& owner;
+
+    public:
+        explicit Worker(LaneScheduler& owner) : Thread("LaneWorker"), owner(owner) {}
+
+        // Posts at most once per sleep, as whoever clears the flag owns the post.
+        void wake() {
+            if (sleeping.exchange(false))
+                wakeUp.release();
+        }
+
+        void run() override {
+            auto spinTicks = Time::getHighResolutionTicksPerSecond() / 20000; // 50us
+            while (!threadShouldExit()) {
+                auto lane = owner.claimJob();
+                if (lane >= 0) {
+                    owner.runJob(lane);
+                    continue;
+                }
+                for (auto until = Time::getHighResolutionTicks() + spinTicks; !owner.hasPendingJobs() && Time::getHighResolutionTicks() < until;) {}
+                if (owner.hasPendingJobs())
+                    continue;
+                sleeping = true;
+                if (owner.hasPendingJobs() || threadShouldExit() || !wakeUp.try_acquire_for(std::chrono::milliseconds(100))) {
+                    // nobody woke us up, unless the flag is already gone, in which case the post is on its way.
+                    if (!sleeping.exchange(false))
+                        wakeUp.acquire();
+                }
+            }
+        }
+
+    private:
+        std::binary_semaphore wakeUp{0};
+        std::atomic<bool> sleeping{false};
+    };
+
+    OwnedArray<Lane> lanes{};
+    OwnedArray<Worker> workers{};
+    std::atomic<bool> parallel{true};
+    std::atomic<bool> nonRealtime{false};
+
+    double ticksPerSample{0};
+
+    // per block state, written by the audio thread at the fork
+    std::atomic<int> scheduled[maxLanes]{};
+    int numScheduled{0};
+    bool published{false};
+    uint32 generation{0};
+    int64 deadlineTicks{0};
+
+    // generation (16 bits) | number of jobs (8 bits) | next job (8 bits). Packing them lets a worker that
+    // still looks at the previous block fail its claim instead of taking a job twice.
+    std::atomic<uint32> jobs{0};
+
+    static uint32 packJobs(uint32 gen, uint32 n, uint32 next) { return (gen << 16) | (n << 8) | next; }
+
+    bool hasPendingJobs() const {
+        auto v = jobs.load();
+        return (v & 0xFF) < ((v >> 8) & 0xFF);
+    }
+
+    int claimJob() {
+        auto v = jobs.load();
+        while ((v & 0xFF) < ((v >> 8) & 0xFF)) {
+            // read before claiming: once the claim succeeds, the audio thread may be past the join already.
+            auto lane = scheduled[v & 0xFF].load(std::memory_order_relaxed);
+            if (jobs.compare_exchange_weak(v, v + 1))
+                return lane;
+        }
+        return -1;
+    }
+
+    void runJob(int index) {
+        auto lane = lanes.getUnchecked(index);
+        lane->process();
+        lane->running.store(false, std::memory_order_release);
+    }
+
+    bool areScheduledLanesFinished() const {
+        for (int i = 0; i < numScheduled; i++)
+            if (lanes.getUnchecked(scheduled[i].load(std::memory_order_relaxed))->running.load(std::memory_order_acquire))
+                return false;
+        return true;
+    }
+};
+
+// Pass-through nodes placed at the head and the tail of the main chain.
+class LaneForkProcessor : public AudioProcessor {
+    LaneScheduler& scheduler;
+
+public:
+    explicit LaneForkProcessor(LaneScheduler& scheduler)
+    : AudioProcessor(BusesProperties().withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
+                             .withOutput ("Output", juce::AudioChannelSet::stereo(), true)),
+      scheduler(scheduler) {}
+
+    void prepareToPlay(double sampleRate, int samplesPerBlock) override { scheduler.prepare(sampleRate, samplesPerBlock); }
+    void releaseResources() override { scheduler.release(); }
+    void processBlock(AudioBuffer<float>& buffer, MidiBuffer& midiBuffer) override { scheduler.fork(buffer, midiBuffer); }
+    // the graph passes it on to its nodes, and the lanes are graphs of their own.
+    void setNonRealtime(bool isNonRealtime) noexcept override {
+        AudioProcessor::setNonRealtime(isNonRealtime);
+        scheduler.setNonRealtime(isNonRealtime);
+    }
+
+    AudioProcessorEditor* createEditor() override { return nullptr; }
+    bool hasEditor() const override { return false; }
+    const String getName() const override { return "LaneForkProcessor"; }
+    void getStateInformation(juce::MemoryBlock& destData) override {}
+    void setStateInformation(const void* data, int sizeInBytes) override {}
+    double getTailLengthSeconds() const override { return 0; }
+    bool acceptsMidi() const override { return true; }
+    bool producesMidi() const override { return true; }
+    int getNumPrograms() override { return 1; }
+    int getCurrentProgram() override { return 0; }
+    void setCurrentProgram(int index) override {}
+    const String getProgramName(int index) override { return String(); }
+    void changeProgramName(int index, const String &newName) override {}
+};
+
+class LaneJoinProcessor : public AudioProcessor {
+    LaneScheduler& scheduler;
+
+public:
+    explicit LaneJoinProcessor(LaneScheduler& scheduler)
+    : AudioProcessor(BusesProperties().withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
+                             .withOutput ("Output", juce::AudioChannelSet::stereo(), true)),
+      scheduler(scheduler) {}
+
+    void prepareToPlay(double sampleRate, int samplesPerBlock) override {}
+    void releaseResources() override {}
+    void processBlock(AudioBuffer<float>& buffer, MidiBuffer& midiBuffer) override { scheduler.join(buffer); }
+
+    AudioProcessorEditor* createEditor() override { return nullptr; }
+    bool hasEditor() const override { return false; }
+    const String getName() const override { return "LaneJoinProcessor"; }
+    void getStateInformation(juce::MemoryBlock& destData) override {}
+    void setStateInformation(const void* data, int sizeInBytes) override {}
+    double getTailLengthSeconds() const override { return 0; }
+    bool acceptsMidi() const override { return false; }
+    bool producesMidi() const override { return false; }
+    int getNumPrograms() override { return 1; }
+    int getCurrentProgram() override { return 0; }
+    void setCurrentProgram(int index) override {}
+    const String getProgramName(int index) override { return String(); }
+    void changeProgramName(int index, const String &newName) override {}
+};
+
+#endif //ANDROIDPLUGINHOST_LANES_H
@@ -7,6 +7,7 @@
 #include "mpe.h"
 #include "audioplayer.h"
 #include "model.h"
+#include "scanner.h"
 
 using namespace juce;
 
@@ -26,10 +27,17 @@ class MainComponent : public Component {
     ComboBox comboBoxPluginFormats{};
     ComboBox comboBoxPluginVendors{};
     ComboBox comboBoxPlugins{};
+    TextEditor textEditorSearchPlugins{};
     ComboBox comboBoxActivePlugins{};
+    Array<AudioProcessorGraph::Node::Ptr> activePluginNodes{}; // in the order of comboBoxActivePlugins
     TextButton buttonAddPlugin{"Add"};
+    ComboBox comboBoxLanes{};
+    Slider sliderLaneNoteRange{Slider::SliderStyle::TwoValueHorizontal, Slider::TextEntryBoxPosition::NoTextBox};
     TextButton buttonRemoveActivePlugin{"Remove"};
     TextButton buttonPlayAudio{"Play Audio"};
+    TextButton buttonPlayFile{"Play File..."};
+    ToggleButton toggleLoopAudio{"Loop audio"};
+    std::unique_ptr<FileChooser> audioFileChooser{nullptr};
     ComboBox comboBoxPresets{};
     TextButton buttonShowUI{"Show UI"};
 
@@ -37,12 +45,19 @@ class MainComponent : public Component {
 
     Label labelStatusText{};
 
+    Label labelDspLoad{};
+    ToggleButton toggleDspTrace{"Record DSP load trace (CSV)"};
+    ToggleButton toggleParallelLanes{"Parallel lanes"};
+    ToggleButton toggleInputMonitoring{"Monitor audio input"};
+    ToggleButton toggleRestoreDeviceSetup{"Restore audio setup"};
+
     ToggleButton mpeToggle{"MPE"};
     MidiKeyboardState midiKeyboardState;
     MidiKeyboardComponent midiKeyboard{midiKeyboardState, KeyboardComponentBase::Orientation::horizontalKeyboard};
     MPEZoneLayout mpeZoneLayout{MPEZone{MPEZone::Type::lower, 7}, MPEZone{MPEZone::Type::upper, 7}};
     MPEInstrument mpeInstrument{mpeZoneLayout};
     MPEKeyboardComponent mpeKeyboard{mpeInstrument, KeyboardComponentBase::Orientation::horizontalKeyboard};
+    std::unique_ptr<MidiKeyboardQueueListener> midiKeyboardListener{nullptr};
     std::unique_ptr<MPEDispatchingListener> mpeListener{nullptr};
 
     TextButton buttonSetupMidiInDevices{"Setup MIDI In"};
@@ -61,9 +76,11 @@ class MainComponent : public Component {
     class PluginWindow : public DocumentWindow {
         MainComponent* owner;
     public:
-        PluginWindow(MainComponent *mainComponent, AudioProcessor* processor)
+        AudioProcessorGraph::Node::Ptr node;
+
+        PluginWindow(MainComponent *mainComponent, AudioProcessor* processor, AudioProcessorGraph::Node::Ptr node)
         : DocumentWindow(processor->getName(), Colours::black, DocumentWindow::TitleBarButtons::allButtons),
-        owner(mainComponent) {}
+        owner(mainComponent), node(node) {}
 
         void closeButtonPressed() override {
             owner->closePluginWindow(this);
@@ -90,9 +107,17 @@ public:
         };
 
         buttonScanPlugins.onClick = [this, formats] {
-            appModel->scanPlugins(formats[comboBoxPluginFormats.getSelectedId() - 1]);
-            updatePluginVendorListOnUI();
-            updatePluginListOnUI();
+            buttonScanPlugins.setEnabled(false);
+            appModel->scanPlugins(formats[comboBoxPluginFormats.getSelectedId() - 1],
+                                  [this](int done, int total, const String& currentFile) {
+                labelStatusText.setText("Scanning " + String(done) + "/" + String(total) + ": " + currentFile,
+                                        NotificationType::dontSendNotification);
+            }, [this] {
+                buttonScanPlugins.setEnabled(true);
+                labelStatusText.setText("Ready", NotificationType::dontSendNotification);
+                updatePluginVendorListOnUI();
+                updatePluginListOnUI();
+            });
         };
 
         static bool isSettingsShown = false;
@@ -129,16 +154,15 @@ public:
         };
 
         comboBoxPlugins.onChange = [&] {
-            bool filtered = comboBoxPluginVendors.getSelectedId() > 1;
-            auto vendor = comboBoxPluginVendors.getText();
-            for (auto& desc : appModel->getKnownPluginList().getTypes()) {
-                if (!filtered || desc.manufacturerName == vendor || (desc.manufacturerName.isEmpty() && vendor == unnamedVendor)) {
-                    if (desc.descriptiveName == comboBoxPlugins.getText()) {
-                        appModel->setSelectedPlugin(desc);
-                        return;
-                    }
-                }
-            }
+            // item IDs are catalog entry IDs + 1.
+            auto id = comboBoxPlugins.getSelectedId();
+            if (id > 0)
+                appModel->setSelectedPlugin(appModel->getPluginCatalog().getDescription(id - 1));
+        };
+
+        textEditorSearchPlugins.setTextToShowWhenEmpty("Search", Colours::grey);
+        textEditorSearchPlugins.onTextChange = [&] {
+            updatePluginListOnUI();
         };
 
         buttonAddPlugin.onClick = [&] {
@@ -147,13 +171,11 @@ public:
                 for (auto format : formatManager.getFormats()) {
                     if (format->getName() != comboBoxPluginFormats.getText())
                         continue;
-                    juce::AudioDeviceManager::AudioDeviceSetup setup;
-                    appModel->getAudioDeviceManager().getAudioDeviceSetup(setup);
-                    format->createPluginInstanceAsync(desc, setup.sampleRate, 1024 * 32, [&](std::unique_ptr<AudioPluginInstance> instance, String error) {
+                    auto lane = comboBoxLanes.getSelectedItemIndex();
+                    format->createPluginInstanceAsync(desc, appModel->getInstanceSampleRate(), appModel->getInstanceBlockSize(),
+                                                      [&, lane](std::unique_ptr<AudioPluginInstance> instance, String error) {
                         if (error.isEmpty()) {
-                            comboBoxActivePlugins.addItem(instance->getName(), comboBoxActivePlugins.getNumItems() + 1);
-                            comboBoxActivePlugins.setSelectedId(comboBoxActivePlugins.getNumItems(), NotificationType::sendNotificationAsync);
-                            auto node = appModel->addActiveInstance(std::move(instance));
+                            addActivePluginOnUI(appModel->addActiveInstance(std::move(instance), lane));
                         } else {
                             AlertWindow::showMessageBoxAsync(MessageBoxIconType::WarningIcon, "Plugin Error", error);
                         }
@@ -189,6 +211,19 @@ public:
             appModel->getAudioPlayer()->playLoadedFile();
         };
 
+        buttonPlayFile.onClick = [&] {
+            audioFileChooser = std::make_unique<FileChooser>("Audio file to play", File{}, appModel->getAudioPlayer()->getSupportedFilePatterns());
+            audioFileChooser->launchAsync(FileBrowserComponent::openMode | FileBrowserComponent::canSelectFiles, [this](const FileChooser& chooser) {
+                auto url = chooser.getURLResult();
+                if (!url.isEmpty() && !appModel->getAudioPlayer()->playURL(url))
+                    labelStatusText.setText("Cannot play " + url.getFileName(), NotificationType::dontSendNotification);
+            });
+        };
+
+        toggleLoopAudio.onClick = [&] {
+            appModel->getAudioPlayer()->setLooping(toggleLoopAudio.getToggleState());
+        };
+
         buttonShowUI.onClick = [&] {
             auto node = getSelectedActivePlugin();
             if (node)
@@ -197,11 +232,13 @@ public:
 
         // setup components
         comboBoxPluginFormats.setBounds(0, 0, 100, 50);
+        textEditorSearchPlugins.setBounds(150, 0, 250, 50);
         buttonScanPlugins.setBounds(0, 50, 150, 50);
         buttonShowAudioSettings.setBounds(200, 50, 150, 50);
         comboBoxPluginVendors.setBounds(0, 100, 400, 50);
         comboBoxPlugins.setBounds(0, 150, 400, 50);
         buttonAddPlugin.setBounds(0, 200, 150, 50);
+        comboBoxLanes.setBounds(200, 200, 200, 50);
         comboBoxActivePlugins.setBounds(0, 250, 400, 50);
         buttonRemoveActivePlugin.setBounds(0, 300, 150, 50);
         buttonPlayAudio.setBounds(200, 300, 150, 50);
@@ -210,26 +247,47 @@ public:
         labelStatusText.setBounds(200, 400, 200, 50);
 
         addAndMakeVisible(comboBoxPluginFormats);
+        addAndMakeVisible(textEditorSearchPlugins);
         addAndMakeVisible(buttonScanPlugins);
         addAndMakeVisible(buttonShowAudioSettings);
         addAndMakeVisible(comboBoxPluginVendors);
         addAndMakeVisible(comboBoxPlugins);
         addAndMakeVisible(buttonAddPlugin);
+        // lane 1 is the main chain, the others run in parallel with it and get mixed into the output.
+        for (int i = 0; i < LaneScheduler::maxLanes; i++)
+            comboBoxLanes.addItem("Lane " + String(i + 1), i + 1);
+        comboBoxLanes.onChange = [&] {
+            updateLaneNoteRangeOnUI();
+        };
+        comboBoxLanes.setSelectedId(1);
+        addAndMakeVisible(comboBoxLanes);
+        // the notes that the selected lane plays, e.g. to split the keyboard between lanes.
+        sliderLaneNoteRange.setRange(0, 127, 1);
+        sliderLaneNoteRange.setBounds(0, 850, 400, 50);
+        sliderLaneNoteRange.onValueChange = [&] {
+            auto lane = comboBoxLanes.getSelectedItemIndex();
+            if (lane > 0)
+                appModel->getLaneScheduler().getLane(lane)->setNoteRange((int) sliderLaneNoteRange.getMinValue(), (int) sliderLaneNoteRange.getMaxValue());
+        };
+        updateLaneNoteRangeOnUI();
+        addAndMakeVisible(sliderLaneNoteRange);
         addAndMakeVisible(comboBoxActivePlugins);
         addAndMakeVisible(buttonRemoveActivePlugin);
         addAndMakeVisible(buttonPlayAudio);
         addAndMakeVisible(comboBoxPresets);
         addAndMakeVisible(buttonShowUI);
         addAndMakeVisible(labelStatusText);
-        labelStatusText.setText("Ready", NotificationType::sendNotificationAsync);
+        labelStatusText.setText(appModel->getPluginCatalog().isDamaged() ? "The plugin list was damaged, please scan plugins again" : "Ready",
+                                NotificationType::sendNotificationAsync);
 
         updatePluginVendorListOnUI();
         updatePluginListOnUI();
         appModel->updateGraph();
 
         // Set MIDI/MPE keyboard
-        midiKeyboardState.addListener(&appModel->getPluginPlayer().getMidiMessageCollector());
-        mpeListener = std::make_unique<MPEDispatchingListener>(appModel->getPluginPlayer().getMidiMessageCollector());
+        midiKeyboardListener = std::make_unique<MidiKeyboardQueueListener>(appModel->getMidiEventQueue());
+        midiKeyboardState.addListener(midiKeyboardListener.get());
+        mpeListener = std::make_unique<MPEDispatchingListener>(appModel->getMidiEventQueue());
         mpeInstrument.addListener(mpeListener.get());
         mpeToggle.setBounds(0, 450, 400, 50);
         mpeToggle.onClick = [&] {
@@ -249,6 +307,52 @@ public:
         addAndMakeVisible(mpeKeyboard);
         mpeKeyboard.setVisible(false);
 
+        // DSP load per node
+        auto& dspLoadMonitor = appModel->getDspLoadMonitor();
+        labelDspLoad.setJustificationType(Justification::topLeft);
+        labelDspLoad.setFont(Font(Font::getDefaultMonospacedFontName(), 12.0f, Font::plain));
+        labelDspLoad.setBounds(0, 550, 400, 150);
+        labelDspLoad.addMouseListener(this, false);
+        addAndMakeVisible(labelDspLoad);
+        dspLoadMonitor.onUpdate = [this] { updateDspLoadOnUI(); };
+        appModel->getPresetCache().onInstanceSwapped = [this](AudioProcessorGraph::Node::Ptr node) { updatePluginUI(node); };
+        toggleDspTrace.setBounds(0, 700, 200, 50);
+        toggleDspTrace.onClick = [this] {
+            auto& monitor = appModel->getDspLoadMonitor();
+            if (!toggleDspTrace.getToggleState()) {
+                monitor.stopTrace();
+                return;
+            }
+            auto file = File::getSpecialLocation(File::userDocumentsDirectory).getChildFile("AndroidPluginHost-dsp-trace.csv");
+            if (monitor.startTrace(file))
+                labelStatusText.setText("Tracing to " + file.getFullPathName(), NotificationType::dontSendNotification);
+            else
+                toggleDspTrace.setToggleState(false, NotificationType::dontSendNotification);
+        };
+        addAndMakeVisible(toggleDspTrace);
+        toggleParallelLanes.setBounds(200, 700, 200, 50);
+        toggleParallelLanes.setToggleState(appModel->getLaneScheduler().isParallelProcessingEnabled(), NotificationType::dontSendNotification);
+        toggleParallelLanes.onClick = [this] {
+            appModel->getLaneScheduler().setParallelProcessingEnabled(toggleParallelLanes.getToggleState());
+        };
+        addAndMakeVisible(toggleParallelLanes);
+        toggleInputMonitoring.setBounds(0, 750, 200, 50);
+        toggleInputMonitoring.setEnabled(RuntimePermissions::isGranted(RuntimePermissions::recordAudio));
+        toggleInputMonitoring.onClick = [this] {
+            appModel->setInputMonitoringEnabled(toggleInputMonitoring.getToggleState());
+        };
+        addAndMakeVisible(toggleInputMonitoring);
+        toggleRestoreDeviceSetup.setBounds(200, 750, 200, 50);
+        toggleRestoreDeviceSetup.setToggleState(appModel->isDeviceSetupRestoreEnabled(), NotificationType::dontSendNotification);
+        toggleRestoreDeviceSetup.onClick = [this] {
+            appModel->setDeviceSetupRestoreEnabled(toggleRestoreDeviceSetup.getToggleState());
+        };
+        addAndMakeVisible(toggleRestoreDeviceSetup);
+        buttonPlayFile.setBounds(0, 800, 150, 50);
+        addAndMakeVisible(buttonPlayFile);
+        toggleLoopAudio.setBounds(200, 800, 200, 50);
+        addAndMakeVisible(toggleLoopAudio);
+
         /*
         // Setup MIDI devices playgound
         buttonSetupMidiInDevices.onClick = [&] {
@@ -272,10 +376,18 @@ public:
         addAndMakeVisible(comboBoxMidiInDevices);
         addAndMakeVisible(comboBoxMidiOutDevices);
         */
+
+        // the chain of the last session
+        restoreSessionOnUI();
     }
 
     ~MainComponent() {
-
+        appModel->saveSession();
+        midiKeyboardState.removeListener(midiKeyboardListener.get());
+        mpeInstrument.removeListener(mpeListener.get());
+        appModel->getDspLoadMonitor().onUpdate = nullptr;
+        appModel->getDspLoadMonitor().stopTrace();
+        appModel->getPresetCache().onInstanceSwapped = nullptr;
     }
 
     void closePluginWindow(PluginWindow *window) {
@@ -292,69 +404,165 @@ public:
     }
 
     void updatePluginVendorListOnUI() {
-        if (appModel->getKnownPluginList().getNumTypes() == 0)
+        auto& catalog = appModel->getPluginCatalog();
+        if (catalog.getNumTypes() == 0)
             return;
         auto format = getPluginFormats()[comboBoxPluginFormats.getSelectedId() - 1];
-        Array<String> vendors{};
-        for (auto &desc: appModel->getKnownPluginList().getTypesForFormat(*format)) {
-            if (!vendors.contains(desc.manufacturerName))
-                vendors.add(desc.manufacturerName);
-        }
         comboBoxPluginVendors.clear(NotificationType::dontSendNotification);
         comboBoxPluginVendors.addItem(allVendors, 1);
         comboBoxPluginVendors.addItem(unnamedVendor, 2);
-        for (auto &vendor : vendors)
+        for (auto &vendor : catalog.getVendors(format->getName()))
             if (vendor.isNotEmpty()) // sometimes it is empty
                 comboBoxPluginVendors.addItem(vendor, comboBoxPluginVendors.getNumItems() + 2);
         comboBoxPluginVendors.setSelectedId(1, NotificationType::sendNotificationAsync);
     }
 
+    // The search text, if any, takes precedence over the vendor filter.
     void updatePluginListOnUI() {
+        auto& catalog = appModel->getPluginCatalog();
         auto format = getPluginFormats()[comboBoxPluginFormats.getSelectedItemIndex()];
-        bool filtered = comboBoxPluginVendors.getSelectedItemIndex() > 0;
-        auto vendor = comboBoxPluginVendors.getText();
-        Array<PluginDescription> plugins{};
-        for (auto& desc : appModel->getKnownPluginList().getTypesForFormat(*format))
-            if (!filtered || desc.manufacturerName == vendor || (desc.manufacturerName.isEmpty() && vendor == unnamedVendor))
-                plugins.add(desc);
+        auto query = textEditorSearchPlugins.getText().trim();
+        auto vendorIndex = comboBoxPluginVendors.getSelectedItemIndex();
+        auto plugins = query.isNotEmpty() ? catalog.search(query, format->getName(), 200) :
+                       vendorIndex <= 0 ? catalog.getPlugins(format->getName()) :
+                       catalog.getPlugins(format->getName(), vendorIndex == 1 ? String{} : comboBoxPluginVendors.getText());
         comboBoxPlugins.clear(NotificationType::sendNotificationAsync);
-        for (auto& desc : plugins)
-            comboBoxPlugins.addItem(desc.descriptiveName, comboBoxPlugins.getNumItems() + 1);
+        for (auto id : plugins)
+            comboBoxPlugins.addItem(catalog.getDescriptiveName(id), id + 1);
     }
 
     StringArray presetNames{};
 
     void updateActivePluginPresets(AudioProcessorGraph::Node::Ptr node) {
-        auto processor = node->getProcessor();
-        comboBoxPresets.clear();
-        presetNames.clear();
-        for (int32_t i = 0, n = processor->getNumPrograms(); i < n; i++)
-            presetNames.add(processor->getProgramName(i));
-        for (int32_t i = 0, n = processor->getNumPrograms(); i < n; i++) {
+        auto& presetCache = appModel->getPresetCache();
+        comboBoxPresets.clear(NotificationType::dontSendNotification);
+        presetNames = presetCache.getProgramNames(node);
+        for (int32_t i = 0, n = presetNames.size(); i < n; i++)
             comboBoxPresets.addItem(presetNames[i], i + 1);
-        }
+        comboBoxPresets.setSelectedItemIndex(presetCache.getCurrentProgram(node), NotificationType::dontSendNotification);
     }
 
     void setSelectedPreset(AudioProcessorGraph::Node::Ptr node) {
-        auto processor = node->getProcessor();
-        processor->setCurrentProgram(comboBoxPresets.getSelectedItemIndex());
+        auto program = comboBoxPresets.getSelectedItemIndex();
+        if (program >= 0 && !appModel->getPresetCache().recall(node, program))
+            labelStatusText.setText("Preset switched in place (no standby instance)", NotificationType::dontSendNotification);
+    }
+
+    void updateDspLoadOnUI() {
+        String text{"load%  worst(ms) misses  name\n"};
+        int dropped = 0;
+        appModel->getDspLoadMonitor().forEachStats([&](int id, const DspLoadMonitor::Stats& stats) {
+            text << String(stats.load * 100, 1).paddedLeft(' ', 5) << "  "
+                 << String(stats.worstSeconds * 1000, 2).paddedLeft(' ', 9) << "  "
+                 << String(stats.deadlineMisses).paddedLeft(' ', 6) << "  "
+                 << stats.name << "\n";
+            dropped += stats.dropped;
+        });
+        text << "xruns: " << appModel->getDspLoadMonitor().getXRuns() << "  (tap to reset worst/misses)";
+        // records the UI did not drain in time, i.e. the numbers above miss some blocks.
+        if (dropped > 0)
+            text << "  dropped: " << dropped;
+        labelDspLoad.setText(text, NotificationType::dontSendNotification);
+    }
+
+    void mouseUp(const MouseEvent& e) override {
+        if (e.eventComponent == &labelDspLoad)
+            appModel->getDspLoadMonitor().resetWorst();
+    }
+
+    static AudioProcessorEditor* createPluginEditor(AudioProcessor* processor) {
+        return processor->hasEditor() ? processor->createEditorIfNeeded() : new GenericAudioProcessorEditor(*processor);
     }
 
     void showPluginUI(AudioProcessorGraph::Node::Ptr node) {
-        auto processor = node->getProcessor();
-        auto editor = processor->hasEditor() ?
-                processor->createEditorIfNeeded() : new GenericAudioProcessorEditor(*processor);
-        auto window = new PluginWindow(this, processor);
+        auto processor = AppModel::getPluginInstance(node);
+        auto editor = createPluginEditor(processor);
+        auto window = new PluginWindow(this, processor, node);
         pluginWindows.add(window);
         window->setBounds(Desktop::getInstance().getDisplays().getPrimaryDisplay()->userArea.reduced(20));
         window->setContentOwned(editor, true);
         window->setVisible(true);
     }
 
+    // A preset recall swapped the instance of the node, and the open editors still belong to the old one, which
+    // is the standby now. Their windows get an editor of the new one (which also frees the standby of them).
+    void updatePluginUI(AudioProcessorGraph::Node::Ptr node) {
+        for (auto documentWindow : pluginWindows) {
+            auto window = dynamic_cast<PluginWindow*>(documentWindow);
+            if (window == nullptr || window->node != node)
+                continue;
+            auto bounds = window->getBounds();
+            window->clearContentComponent();
+            window->setContentOwned(createPluginEditor(AppModel::getPluginInstance(node)), true);
+            window->setBounds(bounds);
+        }
+    }
+
+    // The main chain always gets all the notes.
+    void updateLaneNoteRangeOnUI() {
+        auto lane = comboBoxLanes.getSelectedItemIndex();
+        auto range = lane > 0 ? appModel->getLaneScheduler().getLane(lane)->getNoteRange() : Range<int>{0, 127};
+        sliderLaneNoteRange.setMinAndMaxValues(range.getStart(), range.getEnd(), NotificationType::dontSendNotification);
+        sliderLaneNoteRange.setEnabled(lane > 0);
+    }
+
+    void addActivePluginOnUI(AudioProcessorGraph::Node::Ptr node) {
+        auto lane = appModel->getLaneOf(node);
+        auto name = AppModel::getPluginInstance(node)->getName();
+        activePluginNodes.add(node);
+        comboBoxActivePlugins.addItem(lane > 0 ? "[lane " + String(lane + 1) + "] " + name : name, comboBoxActivePlugins.getNumItems() + 1);
+        comboBoxActivePlugins.setSelectedId(comboBoxActivePlugins.getNumItems(), NotificationType::sendNotificationAsync);
+    }
+
+    void restoreSessionOnUI() {
+        Session session{};
+        if (!session.load(appModel->getSessionFile()) || session.nodes.empty())
+            return;
+        // the last launch did not get through restoring this session, so one of its plugins may crash us again.
+        auto marker = appModel->getSessionRestoreMarkerFile();
+        if (marker.existsAsFile()) {
+            marker.deleteFile();
+            appModel->keepUnrestored(session);
+            askToKeepUnrestoredPlugins("The last session could not be restored, so it was skipped this time.");
+            return;
+        }
+        marker.create();
+        labelStatusText.setText("Restoring " + String((int) session.nodes.size()) + " plugins...", NotificationType::dontSendNotification);
+        appModel->restoreSession(session, [this, marker](const SessionRestore::Report& report) {
+            marker.deleteFile();
+            for (auto node : report.nodes)
+                addActivePluginOnUI(node);
+            toggleParallelLanes.setToggleState(appModel->getLaneScheduler().isParallelProcessingEnabled(), NotificationType::dontSendNotification);
+            auto text = "Restored in " + String(report.instantiateMs + report.applyStateMs + report.commitMs, 1) + "ms";
+            if (report.launchToFirstAudioMs >= 0)
+                text << ", first audio " << String(report.launchToFirstAudioMs, 1) << "ms after launch";
+            labelStatusText.setText(text, NotificationType::dontSendNotification);
+            Logger::writeToLog("session restore: instantiate " + String(report.instantiateMs, 1) + "ms, state " +
+                               String(report.applyStateMs, 1) + "ms, commit " + String(report.commitMs, 1) +
+                               "ms, first audio " + String(report.firstAudioMs, 1) + "ms (" +
+                               String(report.launchToFirstAudioMs, 1) + "ms after launch)");
+            if (!report.errors.isEmpty())
+                askToKeepUnrestoredPlugins(report.errors.joinIntoString("\n"));
+        });
+    }
+
+    // Plugins that are not there now (e.g. not installed yet, or their service did not respond) stay in the
+    // session unless the user says otherwise.
+    void askToKeepUnrestoredPlugins(const String& message) {
+        AlertWindow::showOkCancelBox(MessageBoxIconType::WarningIcon, "Plugin Error",
+                                     message + "\n\nKeep the " + String(appModel->getNumUnrestoredPlugins()) +
+                                     " plugins that are not restored in the session, to try them again on the next launch?",
+                                     "Keep", "Remove", nullptr,
+                                     ModalCallbackFunction::create([](int result) {
+            if (result == 0)
+                appModel->discardUnrestoredPlugins();
+        }));
+    }
+
     AudioProcessorGraph::Node::Ptr getSelectedActivePlugin() {
         auto index = comboBoxActivePlugins.getSelectedItemIndex();
         if (index >= 0)
-            return appModel->getActivePlugins()[index];
+            return activePluginNodes[index];
         return nullptr;
     }
 };
@@ -376,13 +584,32 @@ public:
     //==============================================================================
     void initialise (const String& commandLine) override
     {
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+        auto worker = std::make_unique<PluginScanWorker>();
+        if (worker->initialiseFromCommandLine(commandLine, PLUGIN_SCAN_WORKER_UID, PLUGIN_SCAN_PING_TIMEOUT_MS)) {
+            scanWorker = std::move(worker);
+            return;
+        }
+#endif
         mainWindow = std::make_unique<MainAppWindow> (getApplicationName());
 
 
     }
 
+    // Android may kill the app without shutting it down once it is in the background.
+    void suspended() override {
+        if (appModel)
+            appModel->saveSession();
+    }
+
     bool backButtonPressed() override    { return true; }
-    void shutdown() override             { mainWindow = nullptr; }
+    void shutdown() override
+    {
+        mainWindow = nullptr;
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+        scanWorker = nullptr;
+#endif
+    }
 
     //==============================================================================
     void systemRequestedQuit() override                   { quit(); }
@@ -440,6 +667,9 @@ private:
     };
 
     std::unique_ptr<MainAppWindow> mainWindow;
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+    std::unique_ptr<PluginScanWorker> scanWorker;
+#endif
     ApplicationCommandManager commandManager;
 };
 
@@ -0,0 +1,223 @@
+#ifndef ANDROIDPLUGINHOST_MIDIQUEUE_H
+#define ANDROIDPLUGINHOST_MIDIQUEUE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <juce_audio_basics/juce_audio_basics.h>
+#include <juce_audio_processors/juce_audio_processors.h>
+
+using namespace juce;
+
+// A MIDI 2.0 channel voice message (UMP message type 4) with a single high resolution timestamp.
+// Values are kept in MIDI 2.0 resolution until they reach the graph. The graph only carries MIDI 1.0 though,
+// so plugins get 7-bit velocity, pressure and controller values, and 14-bit pitch bend (see toMidi1()).
+struct MidiEvent {
+    int64 ticks{0}; // Time::getHighResolutionTicks()
+    uint32 words[2]{0, 0};
+
+    enum Status : uint8 {
+        noteOff = 0x8,
+        noteOn = 0x9,
+        controlChange = 0xB,
+        channelPressure = 0xD,
+        pitchBend = 0xE
+    };
+
+    uint8 getStatus() const { return (uint8) ((words[0] >> 20) & 0xF); }
+    uint8 getChannel() const { return (uint8) ((words[0] >> 16) & 0xF); } // 0-based
+    uint8 getIndex() const { return (uint8) ((words[0] >> 8) & 0x7F); } // note number or CC index
+
+    static MidiEvent create(int64 ticks, Status status, int channel, int index, uint32 value) {
+        MidiEvent e{};
+        e.ticks = ticks;
+        e.words[0] = (0x4u << 28) | ((uint32) status << 20) | ((uint32) (channel & 0xF) << 16) | ((uint32) (index & 0x7F) << 8);
+        e.words[1] = value;
+        return e;
+    }
+    static MidiEvent noteOnEvent(int64 ticks, int channel, int note, uint16 velocity) {
+        return create(ticks, noteOn, channel, note, (uint32) velocity << 16);
+    }
+    static MidiEvent noteOffEvent(int64 ticks, int channel, int note, uint16 velocity) {
+        return create(ticks, noteOff, channel, note, (uint32) velocity << 16);
+    }
+
+    // Min-center-max upscaling as specified by the MIDI 2.0 protocol.
+    static uint32 scaleUp(uint32 value, int sourceBits, int destinationBits) {
+        auto scaleBits = destinationBits - sourceBits;
+        auto shifted = value << scaleBits;
+        auto center = 1u << (sourceBits - 1);
+        if (value <= center)
+            return shifted;
+        auto repeatBits = sourceBits - 1;
+        auto repeatValue = value & ((1u << repeatBits) - 1);
+        repeatValue = scaleBits > repeatBits ? repeatValue << (scaleBits - repeatBits) : repeatValue >> (repeatBits - scaleBits);
+        while (repeatValue != 0) {
+            shifted |= repeatValue;
+            repeatValue >>= repeatBits;
+        }
+        return shifted;
+    }
+
+    // Down-converts to MIDI 1.0 bytes, keeping the most significant bits: 14 for pitch bend, 7 for everything else.
+    // Returns the number of bytes written.
+    int toMidi1(uint8* bytes) const {
+        auto channel = getChannel();
+        auto value = words[1];
+        switch (getStatus()) {
+            case noteOn:
+            case noteOff:
+                bytes[0] = (uint8) ((getStatus() << 4) | channel);
+                bytes[1] = getIndex();
+                bytes[2] = (uint8) (value >> 25);
+                // a MIDI 1.0 note-on with zero velocity would be a note-off.
+                if (getStatus() == noteOn && bytes[2] == 0)
+                    bytes[2] = 1;
+                return 3;
+            case controlChange:
+                bytes[0] = (uint8) (0xB0 | channel);
+                bytes[1] = getIndex();
+                bytes[2] = (uint8) (value >> 25);
+                return 3;
+            case channelPressure:
+                bytes[0] = (uint8) (0xD0 | channel);
+                bytes[1] = (uint8) (value >> 25);
+                return 2;
+            case pitchBend: {
+                auto bend = value >> 18; // LSB first
+                bytes[0] = (uint8) (0xE0 | channel);
+                bytes[1] = (uint8) (bend & 0x7F);
+                bytes[2] = (uint8) ((bend >> 7) & 0x7F);
+                return 3;
+            }
+            default:
+                return 0;
+        }
+    }
+};
+
+// Preallocated single producer (the message thread) / single consumer (the audio thread) queue.
+class MidiEventQueue {
+public:
+    static constexpr int capacity = 4096;
+
+    bool push(const MidiEvent& event) {
+        if (fifo.getFreeSpace() == 0)
+            return false;
+        fifo.write(1).forEach([&](int index) { events[(size_t) index] = event; });
+        return true;
+    }
+
+    template <typename Func>
+    void drain(Func&& func) {
+        fifo.read(fifo.getNumReady()).forEach([&](int index) { func(events[(size_t) index]); });
+    }
+
+private:
+    AbstractFifo fifo{capacity};
+    std::array<MidiEvent, capacity> events{};
+};
+
+// Feeds the queued events into the graph, placing them at their sample positions. Events are placed relative
+// to the previous callback, which adds one block of constant latency but no jitter.
+// Pitch bend and channel pressure updates for the same channel within a block are coalesced into the last one,
+// unless a note starts or ends on that channel in between.
+class MidiEventSourceProcessor : public AudioProcessor {
+    MidiEventQueue queue{};
+    std::array<MidiEvent, MidiEventQueue::capacity> pending{};
+    int64 lastBlockTicks{0};
+    double samplesPerTick{0};
+
+public:
+    MidiEventSourceProcessor() : AudioProcessor(BusesProperties()) {}
+
+    MidiEventQueue& getQueue() { return queue; }
+
+    void prepareToPlay(double sampleRate, int samplesPerBlock) override {
+        samplesPerTick = sampleRate / (double) Time::getHighResolutionTicksPerSecond();
+        lastBlockTicks = 0;
+    }
+    void releaseResources() override {}
+
+    void processBlock(AudioBuffer<float>& buffer, MidiBuffer& midiBuffer) override {
+        midiBuffer.clear();
+        auto now = Time::getHighResolutionTicks();
+        auto blockStart = lastBlockTicks != 0 ? lastBlockTicks : now;
+        lastBlockTicks = now;
+
+        int numPending = 0;
+        int lastPitchBend[16], lastPressure[16];
+        std::fill(std::begin(lastPitchBend), std::end(lastPitchBend), -1);
+        std::fill(std::begin(lastPressure), std::end(lastPressure), -1);
+        queue.drain([&](const MidiEvent& event) {
+            auto channel = event.getChannel();
+            switch (event.getStatus()) {
+                case MidiEvent::pitchBend:
+                    if (lastPitchBend[channel] >= 0) {
+                        pending[(size_t) lastPitchBend[channel]] = event;
+                        return;
+                    }
+                    lastPitchBend[channel] = numPending;
+                    break;
+                case MidiEvent::channelPressure:
+                    if (lastPressure[channel] >= 0) {
+                        pending[(size_t) lastPressure[channel]] = event;
+                        return;
+                    }
+                    lastPressure[channel] = numPending;
+                    break;
+                case MidiEvent::noteOn:
+                case MidiEvent::noteOff:
+                    lastPitchBend[channel] = -1;
+                    lastPressure[channel] = -1;
+                    break;
+                default:
+                    break;
+            }
+            pending[(size_t) numPending++] = event;
+        });
+
+        auto lastSample = jmax(0, buffer.getNumSamples() - 1);
+        for (int i = 0; i < numPending; i++) {
+            uint8 bytes[3];
+            auto size = pending[(size_t) i].toMidi1(bytes);
+            auto position = (int64) ((double) (pending[(size_t) i].ticks - blockStart) * samplesPerTick);
+            if (size > 0)
+                midiBuffer.addEvent(bytes, size, (int) jlimit((int64) 0, (int64) lastSample, position));
+        }
+    }
+
+    AudioProcessorEditor* createEditor() override { return nullptr; }
+    bool hasEditor() const override { return false; }
+    const String getName() const override { return "MidiEventSourceProcessor"; }
+    void getStateInformation(juce::MemoryBlock& destData) override {}
+    void setStateInformation(const void* data, int sizeInBytes) override {}
+    double getTailLengthSeconds() const override { return 0; }
+    bool acceptsMidi() const override { return false; }
+    bool producesMidi() const override { return true; }
+    bool isMidiEffect() const override { return true; }
+    int getNumPrograms() override { return 1; }
+    int getCurrentProgram() override { return 0; }
+    void setCurrentProgram(int index) override {}
+    const String getProgramName(int index) override { return String(); }
+    void changeProgramName(int index, const String &newName) override {}
+};
+
+class MidiKeyboardQueueListener : public MidiKeyboardState::Listener {
+    MidiEventQueue& queue;
+
+public:
+    explicit MidiKeyboardQueueListener(MidiEventQueue& queue) : queue(queue) {}
+
+    void handleNoteOn(MidiKeyboardState*, int midiChannel, int midiNoteNumber, float velocity) override {
+        queue.push(MidiEvent::noteOnEvent(Time::getHighResolutionTicks(), midiChannel - 1, midiNoteNumber,
+                                          (uint16) jlimit(0, 0xFFFF, roundToInt(velocity * 0xFFFF))));
+    }
+
+    void handleNoteOff(MidiKeyboardState*, int midiChannel, int midiNoteNumber, float velocity) override {
+        queue.push(MidiEvent::noteOffEvent(Time::getHighResolutionTicks(), midiChannel - 1, midiNoteNumber,
+                                           (uint16) jlimit(0, 0xFFFF, roundToInt(velocity * 0xFFFF))));
+    }
+};
+
+#endif //ANDROIDPLUGINHOST_MIDIQUEUE_H
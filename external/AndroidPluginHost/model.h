@@ -2,7 +2,18 @@
 #define ANDROIDPLUGINHOST_MODEL_H
 
 #include "audioplayer.h"
+#include "catalog.h"
+#include "midiqueue.h"
+#include "scanner.h"
+#include "instrumentation.h"
+#include "lanes.h"
+#include "presets.h"
+#include "session.h"
+#include "topology.h"
+#include <set>
 #include <juce_audio_processors/juce_audio_processors.h>
+#include <juce_audio_devices/juce_audio_devices.h>
+#include <juce_audio_utils/juce_audio_utils.h>
 
 #if JUCEAAP_ENABLED
 #include <aap_audio_plugin_client/aap_audio_plugin_client.h>
@@ -14,26 +25,48 @@
 #ifndef APPLICATION_VERSION
 #define APPLICATION_VERSION "0.1.0"
 #endif
-#define SETTINGS_PLUGIN_LIST "plugin-list"
+#define SETTINGS_PLUGIN_LIST "plugin-list" // only read to migrate to the plugin catalog
+#define SETTINGS_RESTORE_DEVICE_SETUP "restore-device-setup"
 
 using namespace juce;
 
-class AppModel {
+class AppModel : private ChangeListener {
+    int64 launchTicks{Time::getHighResolutionTicks()};
     ApplicationProperties settings{};
     AudioDeviceManager audioDeviceManager{};
-    KnownPluginList knownPluginList{};
+    std::unique_ptr<PluginCatalog> pluginCatalog{nullptr};
+    KnownPluginList knownPluginList{}; // what the scanner works on, filled from the catalog on the first scan
+    bool knownPluginListLoaded{false};
     AudioPluginFormatManager pluginFormatManager{};
     PluginDescription selectedPlugin{};
 #if JUCEAAP_ENABLED
     std::unique_ptr<juceaap::AndroidAudioPluginFormat> androidAudioPluginFormat{nullptr};
 #endif
+    std::unique_ptr<PluginScanner> pluginScanner{nullptr};
+    LaneScheduler laneScheduler{};
     AudioProcessorGraph graph{};
     AudioProcessorPlayer player{};
+    InstrumentedAudioCallback instrumentedPlayer{player};
+    DspLoadMonitor dspLoadMonitor{};
+    PresetCache presetCache{pluginFormatManager};
     AudioProcessorGraph::Node::Ptr audioInputNode{nullptr}, audioOutputNode{nullptr},
-        midiInputNode{nullptr}, midiOutputNode{nullptr}, audioPlayerNode{nullptr};
+        midiInputNode{nullptr}, midiOutputNode{nullptr}, audioPlayerNode{nullptr}, midiEventSourceNode{nullptr},
+        laneForkNode{nullptr}, laneJoinNode{nullptr};
+    std::unique_ptr<SessionRestore> sessionRestore{nullptr};
+    // The session nodes whose plugins could not be instantiated, kept so that saving does not lose them. They go
+    // after the node they followed in their lane (0: the beginning of the lane), so that a later launch that
+    // can instantiate them gets the same chain back.
+    struct UnrestoredNode {
+        Session::Node node;
+        uint32 afterNodeId;
+    };
+    std::vector<UnrestoredNode> unrestoredNodes{};
+    bool openedAudioDevice;
+    bool inputMonitoring{false}; // off, as the mic going straight to the speakers feeds back on phones
 
 public:
-    AppModel() {
+    // Without an audio device (e.g. offline rendering), the caller drives the graph by itself.
+    explicit AppModel(bool openAudioDevice = true) : openedAudioDevice(openAudioDevice) {
 #if JUCEAAP_ENABLED
         androidAudioPluginFormat = std::make_unique<juceaap::AndroidAudioPluginFormat>();
 #endif
@@ -47,65 +80,96 @@ public:
         options.applicationName = APPLICATION_NAME;
         options.storageFormat = PropertiesFile::StorageFormat::storeAsXML;
         settings.setStorageParameters(options);
-        auto pluginList = settings.getUserSettings()->getXmlValue(SETTINGS_PLUGIN_LIST);
+        auto userSettings = settings.getUserSettings();
+        pluginCatalog = std::make_unique<PluginCatalog>(userSettings->getFile().getSiblingFile("plugin-catalog.bin"));
+        // The settings are parsed as a whole on every launch, so the plugin list of older versions moves out of
+        // them once it is safely in the catalog.
+        bool catalogLoaded = pluginCatalog->load();
+        if (!catalogLoaded)
+            if (auto pluginList = userSettings->getXmlValue(SETTINGS_PLUGIN_LIST)) {
+                pluginCatalog->importXml(*pluginList);
+                catalogLoaded = pluginCatalog->compact();
+            }
+        if (catalogLoaded)
+            userSettings->removeValue(SETTINGS_PLUGIN_LIST);
+        userSettings->saveIfNeeded();
 
-        if (pluginList)
-            knownPluginList.recreateFromXml(*pluginList);
+        pluginScanner = std::make_unique<PluginScanner>(knownPluginList, userSettings->getFile().getSiblingFile("plugin-scan-cache.xml"),
+                                                        userSettings->getFile().getSiblingFile("plugin-scan-in-progress.txt"));
+        // the scanner may have blacklisted what crashed the last session, before the list got filled.
+        for (auto& file : knownPluginList.getBlacklistedFiles())
+            pluginCatalog->addToBlacklist(file);
 
-        audioDeviceManager.initialiseWithDefaultDevices(0, 2);
-        audioDeviceManager.addAudioCallback(&player);
+        // the device input is wired into the chain only when we are allowed to record.
+        auto canRecord = RuntimePermissions::isGranted (RuntimePermissions::recordAudio);
+        if (openAudioDevice) {
+            audioDeviceManager.initialiseWithDefaultDevices(canRecord ? 2 : 0, 2);
+            audioDeviceManager.addAudioCallback(&instrumentedPlayer);
+            audioDeviceManager.addChangeListener(this);
+        }
+        dspLoadMonitor.addSource(DspLoadMonitor::wholeGraphSourceId, "(whole graph)", &instrumentedPlayer.getDspLoadRing());
+        dspLoadMonitor.getXRunCount = [this] { return audioDeviceManager.getXRunCount(); };
 
-        if (RuntimePermissions::isGranted (RuntimePermissions::recordAudio))
+        if (canRecord)
             audioInputNode = graph.addNode(std::make_unique<AudioProcessorGraph::AudioGraphIOProcessor>(AudioProcessorGraph::AudioGraphIOProcessor::audioInputNode));
         midiInputNode = graph.addNode(std::make_unique<AudioProcessorGraph::AudioGraphIOProcessor>(AudioProcessorGraph::AudioGraphIOProcessor::midiInputNode));
         audioOutputNode = graph.addNode(std::make_unique<AudioProcessorGraph::AudioGraphIOProcessor>(AudioProcessorGraph::AudioGraphIOProcessor::audioOutputNode));
         midiOutputNode = graph.addNode(std::make_unique<AudioProcessorGraph::AudioGraphIOProcessor>(AudioProcessorGraph::AudioGraphIOProcessor::midiOutputNode));
         audioPlayerNode = graph.addNode(std::make_unique<AudioFilePlayerProcessor>());
+        midiEventSourceNode = graph.addNode(std::make_unique<MidiEventSourceProcessor>());
+        laneForkNode = graph.addNode(std::make_unique<LaneForkProcessor>(laneScheduler));
+        laneJoinNode = graph.addNode(std::make_unique<LaneJoinProcessor>(laneScheduler));
 
         graph.enableAllBuses();
         player.setProcessor(&graph);
     }
 
     ~AppModel() {
-        audioDeviceManager.removeAudioCallback(&player);
+        pluginScanner.reset();
+        audioDeviceManager.removeChangeListener(this);
+        audioDeviceManager.removeAudioCallback(&instrumentedPlayer);
     }
 
     AudioDeviceManager& getAudioDeviceManager() { return audioDeviceManager; }
     AudioPluginFormatManager& getPluginFormatManager() { return pluginFormatManager; }
-    KnownPluginList& getKnownPluginList() { return knownPluginList; }
+    PluginCatalog& getPluginCatalog() { return *pluginCatalog; }
     AudioProcessorPlayer& getPluginPlayer() { return player; }
+    AudioProcessorGraph& getGraph() { return graph; }
+    DspLoadMonitor& getDspLoadMonitor() { return dspLoadMonitor; }
+    LaneScheduler& getLaneScheduler() { return laneScheduler; }
+    PresetCache& getPresetCache() { return presetCache; }
 
-    void scanPlugins(AudioPluginFormat* format) {
-        OwnedArray<PluginDescription> pluginDescriptions{};
-
-        auto& list = getKnownPluginList();
-        for (auto pd : list.getTypesForFormat(*format))
-            list.removeType(pd);
-
-        auto searchPaths = format->getDefaultLocationsToSearch();
-        auto pluginFiles = format->searchPathsForPlugins(searchPaths, true);
-        for (auto& pluginFile : pluginFiles) {
-            printf("FileOrIdentifier: %s :\n", pluginFile.toRawUTF8());
-            try {
-                if (!list.getBlacklistedFiles().contains(pluginFile))
-                    format->findAllTypesForFile(pluginDescriptions, pluginFile);
-            } catch(std::runtime_error& ex) {
-                // swallow scanner failures
-                list.addToBlacklist(pluginFile);
-                saveKnownPluginList();
-            }
-        }
+    bool isInputMonitoringEnabled() const { return inputMonitoring; }
+    // Whether the device input is mixed into the head of the chain (only possible with the record permission).
+    void setInputMonitoringEnabled(bool enabled) {
+        inputMonitoring = enabled;
+        updateGraph();
+    }
 
-        for (auto pluginDescription : pluginDescriptions)
-            if (pluginDescription->pluginFormatName == format->getName())
-                getKnownPluginList().addType(*pluginDescription);
+    bool isScanningPlugins() { return pluginScanner->isScanning(); }
 
-        saveKnownPluginList();
+    // Scans in the background; only files that changed since the last scan are probed.
+    void scanPlugins(AudioPluginFormat* format,
+                     std::function<void(int done, int total, const String& currentFile)> onProgress,
+                     std::function<void()> onFinished) {
+        if (pluginScanner->isScanning())
+            return;
+        if (!knownPluginListLoaded) {
+            pluginCatalog->fillKnownPluginList(knownPluginList);
+            knownPluginListLoaded = true;
+        }
+        pluginScanner->onProgress = std::move(onProgress);
+        pluginScanner->onFinished = [this, onFinished] {
+            saveKnownPluginList();
+            if (onFinished)
+                onFinished();
+        };
+        pluginScanner->scan(format);
     }
 
+    // Only what the scan changed gets written.
     void saveKnownPluginList() {
-        settings.getUserSettings()->setValue(SETTINGS_PLUGIN_LIST, knownPluginList.createXml().get());
-        settings.saveIfNeeded();
+        pluginCatalog->applyChanges(knownPluginList);
     }
 
     PluginDescription& getSelectedPlugin() { return selectedPlugin; }
@@ -123,72 +187,284 @@ public:
         return dynamic_cast<AudioFilePlayerProcessor*>(audioPlayerNode->getProcessor());
     }
 
-    AudioProcessorGraph::Node::Ptr addActiveInstance(std::unique_ptr<AudioPluginInstance> instance) {
-        auto node = graph.addNode(std::move(instance));
-        updateGraph();
+    // Events from the on-screen keyboards. Device MIDI input still arrives through the AudioProcessorPlayer.
+    MidiEventQueue& getMidiEventQueue() {
+        return dynamic_cast<MidiEventSourceProcessor*>(midiEventSourceNode->getProcessor())->getQueue();
+    }
+
+    // Lane 0 is the main chain; the others run in parallel to it (see LaneScheduler).
+    // Without updateTopology, the node is not connected until updateGraph() and Lane::updateGraph() are called.
+    AudioProcessorGraph::Node::Ptr addActiveInstance(std::unique_ptr<AudioPluginInstance> instance, int lane = 0, bool updateTopology = true) {
+        auto processor = std::make_unique<InstrumentedProcessor>(std::move(instance));
+        auto name = processor->getName();
+        auto& ring = processor->getDspLoadRing();
+        AudioProcessorGraph::Node::Ptr node{};
+        if (lane > 0)
+            node = laneScheduler.getLane(lane)->addPlugin(std::move(processor), updateTopology);
+        else {
+            node = graph.addNode(std::move(processor), std::nullopt, AudioProcessorGraph::UpdateKind::async);
+            if (updateTopology)
+                updateGraph();
+        }
+        dspLoadMonitor.addSource(getDspLoadSourceId(lane, node), lane > 0 ? "[lane " + String(lane + 1) + "] " + name : name, &ring);
+        // offline rendering never switches presets, so it has nothing to create standby instances for.
+        if (openedAudioDevice)
+            presetCache.add(node, getInstanceSampleRate(), getInstanceBlockSize());
         return node;
     }
 
+    // What new plugin instances should be prepared for: the device setup, or the graph without a device.
+    double getInstanceSampleRate() {
+        if (auto device = audioDeviceManager.getCurrentAudioDevice())
+            return device->getCurrentSampleRate();
+        return graph.getSampleRate() > 0 ? graph.getSampleRate() : 44100;
+    }
+    int getInstanceBlockSize() {
+        if (auto device = audioDeviceManager.getCurrentAudioDevice())
+            return device->getCurrentBufferSizeSamples();
+        return graph.getBlockSize() > 0 ? graph.getBlockSize() : 512;
+    }
+
+    File getSessionFile() { return settings.getUserSettings()->getFile().getSiblingFile("session.xml"); }
+    // Exists while a session is being restored, i.e. if it is there at launch, restoring crashed the last one.
+    File getSessionRestoreMarkerFile() { return settings.getUserSettings()->getFile().getSiblingFile("session-restore-in-progress.txt"); }
+
+    // The device setup is the user's (or the OS's) choice, so the one of the session is only applied on request.
+    bool isDeviceSetupRestoreEnabled() { return settings.getUserSettings()->getBoolValue(SETTINGS_RESTORE_DEVICE_SETUP, false); }
+    void setDeviceSetupRestoreEnabled(bool enabled) {
+        settings.getUserSettings()->setValue(SETTINGS_RESTORE_DEVICE_SETUP, enabled);
+        settings.getUserSettings()->saveIfNeeded();
+    }
+
+    int getNumUnrestoredPlugins() const { return (int) unrestoredNodes.size(); }
+    void discardUnrestoredPlugins() { unrestoredNodes.clear(); }
+
+    // Keeps all the nodes of a session that is not restored at all, so that the next save does not lose them.
+    void keepUnrestored(const Session& session) {
+        for (auto& node : session.nodes)
+            unrestoredNodes.push_back({node, 0});
+    }
+
+    Session createSession() {
+        Session session{};
+        session.sampleRate = getInstanceSampleRate();
+        session.blockSize = getInstanceBlockSize();
+        session.parallelLanes = laneScheduler.isParallelProcessingEnabled();
+        std::vector<bool> saved(unrestoredNodes.size(), false);
+        auto addUnrestored = [&](int lane, uint32 afterNodeId) {
+            for (size_t i = 0; i < unrestoredNodes.size(); i++)
+                if (!saved[i] && unrestoredNodes[i].node.lane == lane && unrestoredNodes[i].afterNodeId == afterNodeId) {
+                    session.nodes.push_back(unrestoredNodes[i].node);
+                    saved[i] = true;
+                }
+        };
+        for (int lane = 0; lane < LaneScheduler::maxLanes; lane++)
+            addUnrestored(lane, 0);
+        for (auto node : getActivePlugins()) {
+            auto instance = getPluginInstance(node);
+            auto lane = getLaneOf(node);
+            Session::Node sessionNode{instance->getPluginDescription(), lane};
+            instance->getStateInformation(sessionNode.state);
+            session.nodes.push_back(std::move(sessionNode));
+            addUnrestored(lane, node->nodeID.uid);
+        }
+        // the ones whose predecessor got removed meanwhile go to the end of their lane.
+        for (size_t i = 0; i < unrestoredNodes.size(); i++)
+            if (!saved[i])
+                session.nodes.push_back(unrestoredNodes[i].node);
+        return session;
+    }
+
+    bool saveSession() {
+        // a session that is still being restored would be saved incomplete.
+        if (sessionRestore != nullptr && sessionRestore->isRestoring())
+            return false;
+        return createSession().save(getSessionFile());
+    }
+
+    // Instantiates with the plugin format manager, i.e. asynchronously where the format supports it.
+    void restoreSession(const Session& session, std::function<void(const SessionRestore::Report&)> onRestored) {
+        restoreSession(session, [this](const PluginDescription& desc, AudioPluginFormat::PluginCreationCallback callback) {
+            pluginFormatManager.createPluginInstanceAsync(desc, getInstanceSampleRate(), getInstanceBlockSize(), std::move(callback));
+        }, std::move(onRestored));
+    }
+
+    // Adds the plugins of the session to the current chain. onRestored is called once the first audio
+    // callback has processed the restored chain, or right after the commit without an audio device.
+    void restoreSession(const Session& session, SessionRestore::Instantiator instantiate,
+                        std::function<void(const SessionRestore::Report&)> onRestored) {
+        laneScheduler.setParallelProcessingEnabled(session.parallelLanes);
+        auto device = audioDeviceManager.getCurrentAudioDevice();
+        if (device != nullptr && isDeviceSetupRestoreEnabled()) {
+            auto setup = audioDeviceManager.getAudioDeviceSetup();
+            if (session.sampleRate > 0 && device->getAvailableSampleRates().contains(session.sampleRate))
+                setup.sampleRate = session.sampleRate;
+            if (session.blockSize > 0 && device->getAvailableBufferSizes().contains(session.blockSize))
+                setup.bufferSize = session.blockSize;
+            // changing it restarts the device, so not when it is already running like that.
+            if (setup.sampleRate != device->getCurrentSampleRate() || setup.bufferSize != device->getCurrentBufferSizeSamples())
+                audioDeviceManager.setAudioDeviceSetup(setup, true);
+        }
+
+        auto hasDevice = audioDeviceManager.getCurrentAudioDevice() != nullptr;
+        sessionRestore = std::make_unique<SessionRestore>(session, launchTicks, [this](std::vector<std::unique_ptr<AudioPluginInstance>>& instances) {
+            Array<AudioProcessorGraph::Node::Ptr> nodes{};
+            auto& sessionNodes = sessionRestore->getSession().nodes;
+            uint32 lastNodeIds[LaneScheduler::maxLanes]{};
+            for (auto node : getActivePlugins())
+                lastNodeIds[getLaneOf(node)] = node->nodeID.uid;
+            for (size_t i = 0; i < instances.size(); i++) {
+                auto lane = jlimit(0, LaneScheduler::maxLanes - 1, sessionNodes[i].lane);
+                if (instances[i] == nullptr) {
+                    Session::Node unrestored = sessionNodes[i];
+                    unrestored.lane = lane;
+                    unrestoredNodes.push_back({std::move(unrestored), lastNodeIds[lane]});
+                    continue;
+                }
+                auto node = addActiveInstance(std::move(instances[i]), lane, false);
+                lastNodeIds[lane] = node->nodeID.uid;
+                nodes.add(node);
+            }
+            // one topology update for the whole chain, and the render sequences get rebuilt right away.
+            updateGraph();
+            graph.rebuild();
+            for (int lane = 1; lane < LaneScheduler::maxLanes; lane++) {
+                laneScheduler.getLane(lane)->updateGraph();
+                laneScheduler.getLane(lane)->getGraph().rebuild();
+            }
+            instrumentedPlayer.markNextCallback();
+            return nodes;
+        }, hasDevice ? SessionRestore::FirstAudioProbe{[this] { return instrumentedPlayer.getMarkedCallbackTicks(); }} : nullptr,
+           std::move(onRestored));
+        sessionRestore->start(std::move(instantiate));
+    }
+
     void removeActiveInstance(AudioProcessorGraph::Node::Ptr node) {
-        graph.removeNode(node->nodeID);
+        auto lane = getLaneOf(node);
+        dspLoadMonitor.removeSource(getDspLoadSourceId(lane, node));
+        presetCache.remove(node);
+        if (lane > 0) {
+            laneScheduler.getLane(lane)->removePlugin(node);
+            return;
+        }
+        configuredNodes.erase(node->nodeID);
+        graph.removeNode(node->nodeID, AudioProcessorGraph::UpdateKind::async);
         updateGraph();
     }
 
+    int getLaneOf(AudioProcessorGraph::Node::Ptr node) {
+        for (int lane = 1; lane < LaneScheduler::maxLanes; lane++)
+            if (laneScheduler.getLane(lane)->contains(node))
+                return lane;
+        return 0;
+    }
+
+    // Active plugin nodes host an InstrumentedProcessor that wraps the actual plugin instance.
+    static AudioPluginInstance* getPluginInstance(AudioProcessorGraph::Node::Ptr node) {
+        if (auto instrumented = dynamic_cast<InstrumentedProcessor*>(node->getProcessor()))
+            return instrumented->getInstance();
+        return dynamic_cast<AudioPluginInstance*>(node->getProcessor());
+    }
+
+    // The main chain first, then the other lanes in order.
     Array<AudioProcessorGraph::Node::Ptr> getActivePlugins() {
+        auto ret = getMainChainPlugins();
+        for (int lane = 1; lane < LaneScheduler::maxLanes; lane++)
+            ret.addArray(laneScheduler.getLane(lane)->getPlugins());
+        return ret;
+    }
+
+    TopologyChange computeTopologyChange() {
+        return TopologyChange::compute(graph, getDesiredConnections());
+    }
+
+    void applyTopologyChange(const TopologyChange& change) {
+        change.applyTo(graph);
+    }
+
+    void updateGraph() {
+        configureNewNodes();
+        applyTopologyChange(computeTopologyChange());
+    }
+
+private:
+    std::set<AudioProcessorGraph::NodeID> configuredNodes{};
+
+    // the number of input channels may have changed, and the input wiring depends on it.
+    void changeListenerCallback(ChangeBroadcaster*) override {
+        updateGraph();
+    }
+
+    // IO nodes, and the nodes we create for ourselves; none of them is a plugin.
+    bool isInternalNode(AudioProcessorGraph::Node::Ptr node) {
+        return (audioInputNode != nullptr && node->nodeID == audioInputNode->nodeID) ||
+               node->nodeID == audioOutputNode->nodeID ||
+               node->nodeID == midiInputNode->nodeID ||
+               node->nodeID == midiOutputNode->nodeID ||
+               node->nodeID == audioPlayerNode->nodeID ||
+               node->nodeID == midiEventSourceNode->nodeID ||
+               node->nodeID == laneForkNode->nodeID ||
+               node->nodeID == laneJoinNode->nodeID;
+    }
+
+    static int getDspLoadSourceId(int lane, AudioProcessorGraph::Node::Ptr node) {
+        return (lane << 16) + (int) node->nodeID.uid;
+    }
+
+    Array<AudioProcessorGraph::Node::Ptr> getMainChainPlugins() {
         Array<AudioProcessorGraph::Node::Ptr> ret{};
         for (auto node : graph.getNodes())
-            if ((audioInputNode == nullptr || node->nodeID != audioInputNode->nodeID) &&
-                node->nodeID != audioOutputNode->nodeID &&
-                node->nodeID != midiInputNode->nodeID &&
-                node->nodeID != midiOutputNode->nodeID &&
-                node->nodeID != audioPlayerNode->nodeID)
+            if (!isInternalNode(node))
                 ret.add(node);
         return ret;
     }
 
-    void updateGraph() {
-        for (auto node : graph.getNodes())
-            graph.disconnectNode(node->nodeID);
-        juce::ReferenceCountedArray<AudioProcessorGraph::Node> plugins;
+    void configureNewNodes() {
         for (auto node : graph.getNodes()) {
-            if ((audioInputNode != nullptr && node->nodeID == audioInputNode->nodeID) ||
-                node->nodeID == audioOutputNode->nodeID ||
-                node->nodeID == midiInputNode->nodeID ||
-                node->nodeID == midiOutputNode->nodeID)
+            if ((isInternalNode(node) && node->nodeID != audioPlayerNode->nodeID) ||
+                configuredNodes.find(node->nodeID) != configuredNodes.end())
                 continue;
             node->getProcessor()->setPlayConfigDetails(graph.getMainBusNumInputChannels(),
                                                        graph.getMainBusNumOutputChannels(),
                                                        graph.getSampleRate(),
                                                        graph.getBlockSize());
-            if (node->nodeID != audioPlayerNode->nodeID)
-                plugins.add(node);
+            node->getProcessor()->enableAllBuses();
+            configuredNodes.insert(node->nodeID);
         }
-        // FIXME: connect audioInputNode too.
-        auto prev = audioPlayerNode;
+    }
+
+    std::set<AudioProcessorGraph::Connection> getDesiredConnections() {
+        DesiredConnections desired{graph};
+        auto plugins = getMainChainPlugins();
+
+        // the file player and the monitored device input (mono or stereo) are mixed into the head of the chain.
+        desired.addAudio(audioPlayerNode->nodeID, laneForkNode->nodeID);
+        if (audioInputNode != nullptr && inputMonitoring) {
+            auto numInputChannels = audioInputNode->getProcessor()->getTotalNumOutputChannels();
+            for (int channel = 0; channel < 2 && numInputChannels > 0; ++channel)
+                desired.add({ { audioInputNode->nodeID, jmin(channel, numInputChannels - 1) }, { laneForkNode->nodeID, channel } });
+        }
+
+        // the other lanes run in parallel between the fork and the join, and get mixed in at the join.
+        auto prev = laneForkNode;
         for (auto node : plugins) {
-            for (int channel = 0; channel < 2; ++channel) {
-                if (prev != nullptr)
-                    graph.addConnection ({ { prev->nodeID, channel },
-                                           { node->nodeID, channel } });
-            }
+            desired.addAudio(prev->nodeID, node->nodeID);
             prev = node;
         }
-        for (int channel = 0; channel < 2; ++channel) {
-            graph.addConnection ({ { prev->nodeID, channel },
-                                   { audioOutputNode->nodeID, channel } });
-        }
+        desired.addAudio(prev->nodeID, laneJoinNode->nodeID);
+        desired.addAudio(laneJoinNode->nodeID, audioOutputNode->nodeID);
 
-        prev = midiInputNode;
+        // the device MIDI input and the keyboard events are merged until a plugin produces MIDI.
+        desired.addMidi(midiInputNode->nodeID, laneForkNode->nodeID);
+        desired.addMidi(midiEventSourceNode->nodeID, laneForkNode->nodeID);
+        prev = laneForkNode;
         for (auto node : plugins) {
             if (node->getProcessor()->acceptsMidi())
-                graph.addConnection ({ { prev->nodeID,  juce::AudioProcessorGraph::midiChannelIndex },
-                                       { node->nodeID, juce::AudioProcessorGraph::midiChannelIndex } });
+                desired.addMidi(prev->nodeID, node->nodeID);
             if (node->getProcessor()->producesMidi())
                 prev = node;
         }
-
-        for (auto node : graph.getNodes())
-            node->getProcessor()->enableAllBuses();
+        return desired.get();
     }
 };
 
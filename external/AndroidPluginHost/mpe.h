@@ -2,85 +2,51 @@
 #define ANDROIDPLUGINHOST_MPE_H
 
 #include <juce_audio_basics/juce_audio_basics.h>
+#include "midiqueue.h"
 
 using namespace juce;
 
-// TODO
+// Every message derived from one MPE note change shares a single timestamp.
 class MPEDispatchingListener : public MPEInstrument::Listener
 {
 public:
-    explicit MPEDispatchingListener(MidiMessageCollector& collector) : midiCollector(collector) {}
+    explicit MPEDispatchingListener(MidiEventQueue& queue) : queue(queue) {}
 
     void noteAdded(MPENote note) override {
         createNoteOnMessages(note);
     }
 
 private:
-    MidiMessageCollector& midiCollector;
+    MidiEventQueue& queue;
+
+    // MPEValue is 14-bit.
+    static uint32 toMidi2(MPEValue value) { return MidiEvent::scaleUp((uint32) value.as14BitInt(), 14, 32); }
 
     void createNoteOnMessages(const MPENote& note)
     {
-        Array<MidiMessage> messages;
-
-        int noteNumber = note.initialNote;
-        int channel = note.midiChannel;
-        auto pressure = note.pressure;
-        float timbre = note.timbre.asSignedFloat();
-        float pitchBend = note.pitchbend.asSignedFloat();
-
-        // Add note on message
-        MidiMessage noteOnMessage = MidiMessage::noteOn(channel, noteNumber, pressure.asUnsignedFloat());
-        noteOnMessage.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
-        midiCollector.addMessageToQueue(noteOnMessage);
-
-        // Add channel pressure message
-        MidiMessage channelPressureMessage = MidiMessage::channelPressureChange(channel, pressure.as7BitInt());
-        channelPressureMessage.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
-        midiCollector.addMessageToQueue(channelPressureMessage);
-
-        // Add timbre message FIXME: find correct CC number
-        MidiMessage timbreMessage = MidiMessage::controllerEvent(channel, 74, (int)timbre);
-        timbreMessage.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
-        midiCollector.addMessageToQueue(timbreMessage);
-
-        // Add pitch bend message
-        int pitchBendValue = (int)(pitchBend * 16383.0f);
-        MidiMessage pitchBendMessage = MidiMessage::pitchWheel(channel, pitchBendValue);
-        pitchBendMessage.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
-        midiCollector.addMessageToQueue(pitchBendMessage);
+        auto ticks = Time::getHighResolutionTicks();
+        int channel = note.midiChannel - 1;
+
+        // per-note expressions come first, so that the note starts with them.
+        queue.push(MidiEvent::create(ticks, MidiEvent::pitchBend, channel, 0, toMidi2(note.pitchbend)));
+        queue.push(MidiEvent::create(ticks, MidiEvent::channelPressure, channel, 0, toMidi2(note.pressure)));
+        // MPE timbre is CC #74.
+        queue.push(MidiEvent::create(ticks, MidiEvent::controlChange, channel, 74, toMidi2(note.timbre)));
+        queue.push(MidiEvent::noteOnEvent(ticks, channel, note.initialNote, (uint16) (toMidi2(note.noteOnVelocity) >> 16)));
     }
 
     void noteKeyStateChanged(MPENote changedNote) override
     {
-        // Get the MIDI channel and note number
-        int channel = changedNote.midiChannel;
-
-        // Create pitch bend message
-        float pitchBend = changedNote.pitchbend.asSignedFloat();
-        int pitchBendValue = (int)(pitchBend * 16383.0f);
-        MidiMessage pitchBendMessage = MidiMessage::pitchWheel(channel, pitchBendValue);
-        pitchBendMessage.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
-
-        // Create channel pressure message
-        auto pressure = changedNote.pressure.as7BitInt();
-        MidiMessage channelPressureMessage = MidiMessage::channelPressureChange(channel, pressure);
-        channelPressureMessage.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
-
-        midiCollector.addMessageToQueue(pitchBendMessage);
-        midiCollector.addMessageToQueue(channelPressureMessage);
+        auto ticks = Time::getHighResolutionTicks();
+        int channel = changedNote.midiChannel - 1;
+        queue.push(MidiEvent::create(ticks, MidiEvent::pitchBend, channel, 0, toMidi2(changedNote.pitchbend)));
+        queue.push(MidiEvent::create(ticks, MidiEvent::channelPressure, channel, 0, toMidi2(changedNote.pressure)));
     }
 
     void noteReleased(MPENote releasedNote) override
     {
-        // Get the MIDI channel and note number
-        int channel = releasedNote.midiChannel;
-        int noteNumber = releasedNote.initialNote;
-
-        // Create note-off message
-        MidiMessage noteOffMessage = MidiMessage::noteOff(channel, noteNumber, releasedNote.noteOffVelocity.asUnsignedFloat());
-        noteOffMessage.setTimeStamp(Time::getMillisecondCounterHiRes() * 0.001);
-
-        midiCollector.addMessageToQueue(noteOffMessage);
+        queue.push(MidiEvent::noteOffEvent(Time::getHighResolutionTicks(), releasedNote.midiChannel - 1, releasedNote.initialNote,
+                                           (uint16) (toMidi2(releasedNote.noteOffVelocity) >> 16)));
     }
 };
 
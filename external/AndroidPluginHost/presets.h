@@ -0,0 +1,178 @@
+#ifndef ANDROIDPLUGINHOST_PRESETS_H
+#define ANDROIDPLUGINHOST_PRESETS_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <juce_audio_processors/juce_audio_processors.h>
+#include "instrumentation.h"
+
+using namespace juce;
+
+// Program names per plugin node, and a standby instance of the plugin to switch programs on, so that recalling
+// a preset does not have to call setCurrentProgram() on the instance that the audio thread is processing (which
+// is racy, and slow on many plugins).
+// The standby instance doubles the memory (and for AAP, the service bindings) of a plugin, so only plugins that
+// have more than one program get one. It is requested when the node is added, so that it is usually there by
+// the first recall; a recall that comes earlier waits for it.
+// A recall copies the live state into the standby, switches the program there and crossfades to it; the old
+// live instance becomes the next standby. The copying and the program switch run on a background thread, as
+// they can take long on some plugins; only the standby instance is touched there, besides reading the live state.
+class PresetCache : private Timer {
+public:
+    explicit PresetCache(AudioPluginFormatManager& formatManager) : formatManager(formatManager) {
+        startTimerHz(20);
+    }
+    ~PresetCache() override {
+        stopTimer();
+        pool.removeAllJobs(true, 10000);
+    }
+
+    // Called on the message thread once a node processes another instance than before, so that whatever
+    // shows the old one (e.g. its editor) can switch to the new one.
+    std::function<void(AudioProcessorGraph::Node::Ptr)> onInstanceSwapped{};
+
+    void add(AudioProcessorGraph::Node::Ptr node, double sampleRate, int blockSize) {
+        auto processor = dynamic_cast<InstrumentedProcessor*>(node->getProcessor());
+        if (processor == nullptr)
+            return;
+        auto entry = std::make_unique<Entry>();
+        entry->node = node;
+        entry->processor = processor;
+        auto instance = processor->getInstance();
+        for (int i = 0, n = instance->getNumPrograms(); i < n; i++)
+            entry->programNames.add(instance->getProgramName(i));
+        entry->currentProgram = instance->getCurrentProgram();
+        auto& added = *(entries[node.get()] = std::move(entry));
+        if (added.programNames.size() > 1)
+            requestStandbyInstance(added, sampleRate, blockSize);
+    }
+
+    void remove(AudioProcessorGraph::Node::Ptr node) { entries.erase(node.get()); }
+
+    StringArray getProgramNames(AudioProcessorGraph::Node::Ptr node) {
+        auto it = entries.find(node.get());
+        return it != entries.end() ? it->second->programNames : StringArray{};
+    }
+
+    int getCurrentProgram(AudioProcessorGraph::Node::Ptr node) {
+        auto it = entries.find(node.get());
+        return it != entries.end() ? it->second->currentProgram : -1;
+    }
+
+    // Returns false if it had to switch the live instance in place (as there is no standby instance for it),
+    // which mutes the node meanwhile.
+    bool recall(AudioProcessorGraph::Node::Ptr node, int program) {
+        auto it = entries.find(node.get());
+        if (it == entries.end() || program < 0 || program >= it->second->programNames.size())
+            return false;
+        auto& entry = *it->second;
+        entry.currentProgram = program;
+        auto processor = entry.processor;
+
+        if (entry.standbyState == standbyUnavailable) {
+            processor->suspendProcessing(true);
+            processor->getInstance()->setCurrentProgram(program);
+            processor->suspendProcessing(false);
+            return false;
+        }
+        // the last one wins, see timerCallback().
+        if (entry.standbyState == standbyRequested || entry.preparing || entry.swapping || processor->isSwapping())
+            entry.pendingProgram = program;
+        else
+            prepareSwap(entry, program);
+        return true;
+    }
+
+private:
+    enum StandbyState { standbyRequested, standbyReady, standbyUnavailable };
+
+    struct Entry {
+        AudioProcessorGraph::Node::Ptr node{};
+        InstrumentedProcessor* processor{nullptr};
+        StringArray programNames{};
+        int currentProgram{-1};
+        int pendingProgram{-1};
+        StandbyState standbyState{standbyUnavailable};
+        bool preparing{false};
+        bool swapping{false};
+    };
+
+    AudioPluginFormatManager& formatManager;
+    std::map<AudioProcessorGraph::Node*, std::unique_ptr<Entry>> entries{};
+    ThreadPool pool{1};
+
+    void requestStandbyInstance(Entry& entry, double sampleRate, int blockSize) {
+        entry.standbyState = standbyRequested;
+        WeakReference<PresetCache> weakThis{this};
+        auto key = entry.node.get();
+        formatManager.createPluginInstanceAsync(entry.processor->getInstance()->getPluginDescription(), sampleRate, blockSize,
+                                                [weakThis, key](std::unique_ptr<AudioPluginInstance> standby, const String& error) {
+            if (weakThis == nullptr)
+                return;
+            auto it = weakThis->entries.find(key);
+            if (it == weakThis->entries.end())
+                return;
+            auto& entry = *it->second;
+            // without a standby instance, recall() switches in place.
+            entry.standbyState = standby != nullptr ? standbyReady : standbyUnavailable;
+            if (standby != nullptr)
+                entry.processor->setStandbyInstance(std::move(standby));
+            weakThis->recallPending(entry);
+        });
+    }
+
+    // Whatever is not part of the program (e.g. settings outside of it) carries over from the live instance.
+    // Held notes are carried over by the crossfade itself (see InstrumentedProcessor).
+    void prepareSwap(Entry& entry, int program) {
+        entry.preparing = true;
+        WeakReference<PresetCache> weakThis{this};
+        auto node = entry.node; // keeps the processor alive until the job is done
+        auto processor = entry.processor;
+        auto live = processor->getInstance();
+        auto standby = processor->getStandbyInstance();
+        pool.addJob([weakThis, node, processor, live, standby, program] {
+            MemoryBlock state{};
+            live->getStateInformation(state);
+            standby->reset();
+            standby->setStateInformation(state.getData(), (int) state.getSize());
+            standby->setCurrentProgram(program);
+            MessageManager::callAsync([weakThis, node, processor] {
+                if (weakThis == nullptr)
+                    return;
+                auto it = weakThis->entries.find(node.get());
+                if (it == weakThis->entries.end())
+                    return;
+                auto& entry = *it->second;
+                entry.preparing = false;
+                processor->swapToStandbyInstance();
+                entry.swapping = true;
+            });
+        });
+    }
+
+    void recallPending(Entry& entry) {
+        if (entry.pendingProgram < 0)
+            return;
+        auto program = entry.pendingProgram;
+        entry.pendingProgram = -1;
+        recall(entry.node, program);
+    }
+
+    void timerCallback() override {
+        for (auto& it : entries) {
+            auto& entry = *it.second;
+            if (entry.swapping && !entry.processor->isSwapping()) {
+                entry.swapping = false;
+                if (onInstanceSwapped)
+                    onInstanceSwapped(entry.node);
+            }
+            if (!entry.preparing && !entry.swapping && entry.standbyState != standbyRequested)
+                recallPending(entry);
+        }
+    }
+
+    JUCE_DECLARE_WEAK_REFERENCEABLE(PresetCache)
+};
+
+#endif //ANDROIDPLUGINHOST_PRESETS_H
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+#include <juce_data_structures/juce_data_structures.h>
+#include <juce_audio_devices/juce_audio_devices.h>
+#include <juce_audio_utils/juce_audio_utils.h>
+#include "audioplayer.h"
+#include "model.h"
+
+using namespace juce;
+
+// Headless, faster-than-realtime renderer for the plugin chain that AppModel builds.
+// It is meant to be a reproducible benchmark on hosts without any audio device.
+
+static std::atomic<int64> allocationCount{0};
+
+// Every replaceable overload is counted, including the aligned ones that over-aligned types (alignas() beyond
+// the default new alignment, as used for SIMD data) go through, and the nothrow ones.
+static void* allocate(std::size_t size) noexcept {
+    ++allocationCount;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+// malloc's own pointer is kept right before the aligned block, so that it can be freed on any platform.
+static void* allocateAligned(std::size_t size, std::align_val_t alignment) noexcept {
+    ++allocationCount;
+    auto align = (std::uintptr_t) alignment;
+    auto raw = std::malloc(size + align + sizeof(void*));
+    if (raw == nullptr)
+        return nullptr;
+    auto aligned = ((std::uintptr_t) raw + sizeof(void*) + align - 1) & ~(align - 1);
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return reinterpret_cast<void*>(aligned);
+}
+
+static void freeAligned(void* ptr) noexcept {
+    if (ptr != nullptr)
+        std::free(static_cast<void**>(ptr)[-1]);
+}
+
+void* operator new(std::size_t size) {
+    if (auto ptr = allocate(size))
+        return ptr;
+    throw std::bad_alloc{};
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (auto ptr = allocateAligned(size, alignment))
+        return ptr;
+    throw std::bad_alloc{};
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocateAligned(size, alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return allocateAligned(size, alignment); }
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { freeAligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { freeAligned(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { freeAligned(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { freeAligned(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { freeAligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { freeAligned(ptr); }
+
+class OfflineRenderer {
+    AppModel model{false};
+    AudioFormatManager audioFormatManager{};
+
+public:
+    struct Options {
+        Array<StringArray> lanes{}; // plugin IDs per lane, the first one being the main chain
+        bool serial{false};
+        File session{};
+        File saveSession{};
+        File input{};
+        File midi{};
+        File output{};
+        int blockSize{512};
+        double tailSeconds{1.0};
+    };
+
+    OfflineRenderer() {
+        audioFormatManager.registerBasicFormats();
+    }
+
+    void listPlugins() {
+        auto& catalog = model.getPluginCatalog();
+        catalog.forEachType([&](int id) {
+            std::cout << catalog.getIdentifier(id) << "\t" << catalog.getDescriptiveName(id) << std::endl;
+        });
+    }
+
+    // The same XML as KnownPluginList uses, e.g. to move the plugin list between hosts.
+    bool importPlugins(const File& file) {
+        auto xml = parseXML(file);
+        if (xml == nullptr) {
+            std::cerr << "Cannot read the plugin list: " << file.getFullPathName() << std::endl;
+            return false;
+        }
+        auto& catalog = model.getPluginCatalog();
+        catalog.importXml(*xml);
+        return catalog.compact();
+    }
+
+    bool exportPlugins(const File& file) {
+        if (!model.getPluginCatalog().createXml()->writeTo(file)) {
+            std::cerr << "Cannot write the plugin list: " << file.getFullPathName() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    int render(const Options& options) {
+        std::unique_ptr<AudioFormatReader> reader{options.input == File{} ?
+                                                  AudioFilePlayerProcessor::createSampleReader() :
+                                                  audioFormatManager.createReaderFor(options.input)};
+        if (reader == nullptr) {
+            std::cerr << "Cannot read the input audio: " << options.input.getFullPathName() << std::endl;
+            return 1;
+        }
+        auto sampleRate = reader->sampleRate;
+        auto blockSize = options.blockSize;
+        auto inputLength = reader->lengthInSamples;
+
+        MidiMessageSequence midiSequence{};
+        if (options.midi != File{} && !loadMidiFile(options.midi, midiSequence))
+            return 1;
+
+        // the graph must know the render settings before plugins are added, so that they get configured for them.
+        auto& graph = model.getGraph();
+        graph.setPlayConfigDetails(0, 2, sampleRate, blockSize);
+        auto restoreStart = Time::getHighResolutionTicks();
+        std::unique_ptr<SessionRestore::Report> restoreReport{};
+        if (options.session != File{}) {
+            Session session{};
+            if (!session.load(options.session)) {
+                std::cerr << "Cannot read the session: " << options.session.getFullPathName() << std::endl;
+                return 1;
+            }
+            // instantiated synchronously here, as there is no message loop to wait for asynchronous formats.
+            model.restoreSession(session, [&](const PluginDescription& desc, AudioPluginFormat::PluginCreationCallback callback) {
+                String error{};
+                auto instance = model.getPluginFormatManager().createPluginInstance(desc, sampleRate, blockSize, error);
+                callback(std::move(instance), error);
+            }, [&](const SessionRestore::Report& report) {
+                restoreReport = std::make_unique<SessionRestore::Report>(report);
+            });
+            if (restoreReport == nullptr || !restoreReport->errors.isEmpty()) {
+                std::cerr << "Failed to restore the session: " << (restoreReport != nullptr ? restoreReport->errors.joinIntoString(", ") : String{}) << std::endl;
+                return 1;
+            }
+        }
+        if (options.serial)
+            model.getLaneScheduler().setParallelProcessingEnabled(false);
+        for (int lane = 0; lane < options.lanes.size(); lane++)
+            for (auto& id : options.lanes.getReference(lane))
+                if (!addPlugin(id, sampleRate, blockSize, lane))
+                    return 1;
+        if (options.saveSession != File{} && !model.createSession().save(options.saveSession)) {
+            std::cerr << "Cannot write the session: " << options.saveSession.getFullPathName() << std::endl;
+            return 1;
+        }
+        // non-realtime also makes the file player decode or read the input on this thread, instead of on its background threads.
+        graph.setNonRealtime(true);
+        graph.prepareToPlay(sampleRate, blockSize);
+
+        double tailSeconds = options.tailSeconds;
+        int numLanes = 1;
+        for (auto node : model.getActivePlugins()) {
+            tailSeconds = jmax(tailSeconds, jmin(10.0, node->getProcessor()->getTailLengthSeconds()));
+            numLanes = jmax(numLanes, model.getLaneOf(node) + 1);
+        }
+        // a MIDI file that is longer than the audio input (e.g. driving a synth) is rendered to its end.
+        auto contentLength = jmax(inputLength, (int64) std::ceil(midiSequence.getEndTime() * sampleRate));
+        auto totalLength = contentLength + (int64) (tailSeconds * sampleRate);
+
+        std::unique_ptr<AudioFormatWriter> writer{};
+        if (options.output != File{}) {
+            options.output.deleteFile();
+            auto stream = options.output.createOutputStream();
+            if (stream == nullptr) {
+                std::cerr << "Cannot write to " << options.output.getFullPathName() << std::endl;
+                return 1;
+            }
+            WavAudioFormat wav;
+            writer.reset(wav.createWriterFor(stream.get(), sampleRate, 2, 32, {}, 0));
+            if (writer == nullptr) {
+                std::cerr << "Cannot create a WAV writer for " << options.output.getFullPathName() << std::endl;
+                return 1;
+            }
+            stream.release(); // owned by the writer now
+        }
+
+        // the reader was only needed for the input format; the player opens the input by itself.
+        reader.reset();
+        auto player = model.getAudioPlayer();
+        if (options.input == File{})
+            player->playLoadedFile();
+        else if (!player->playFile(options.input)) {
+            std::cerr << "Cannot play the input audio: " << options.input.getFullPathName() << std::endl;
+            return 1;
+        }
+
+        AudioBuffer<float> buffer{2, blockSize};
+        MidiBuffer midiBuffer{};
+        midiBuffer.ensureSize(4096);
+        auto numBlocks = (size_t) ((totalLength + blockSize - 1) / blockSize);
+        std::vector<double> blockTimes(numBlocks);
+        int64 totalAllocations = 0;
+        int midiIndex = 0;
+
+        auto renderStart = Time::getHighResolutionTicks();
+        for (size_t block = 0; block < numBlocks; block++) {
+            auto position = (int64) block * blockSize;
+            auto numSamples = (int) jmin((int64) blockSize, totalLength - position);
+
+            buffer.setSize(2, numSamples, false, false, true);
+            buffer.clear();
+            midiBuffer.clear();
+            auto blockEnd = (double) (position + numSamples) / sampleRate;
+            for (; midiIndex < midiSequence.getNumEvents(); midiIndex++) {
+                auto& message = midiSequence.getEventPointer(midiIndex)->message;
+                if (message.getTimeStamp() >= blockEnd)
+                    break;
+                auto offset = (int64) (message.getTimeStamp() * sampleRate) - position;
+                midiBuffer.addEvent(message, (int) jlimit((int64) 0, (int64) numSamples - 1, offset));
+            }
+
+            auto allocationsBefore = allocationCount.load();
+            auto blockStart = Time::getHighResolutionTicks();
+            graph.processBlock(buffer, midiBuffer);
+            blockTimes[block] = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - blockStart);
+            totalAllocations += allocationCount.load() - allocationsBefore;
+            if (block == 0 && restoreReport != nullptr)
+                restoreReport->firstAudioMs = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - restoreStart) * 1000.0;
+
+            if (writer != nullptr)
+                writer->writeFromAudioSampleBuffer(buffer, 0, numSamples);
+        }
+        auto renderSeconds = Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - renderStart);
+
+        writer.reset();
+        graph.releaseResources();
+
+        if (restoreReport != nullptr)
+            std::cout << "session restore: instantiate " << String(restoreReport->instantiateMs, 1)
+                      << "ms / state " << String(restoreReport->applyStateMs, 1)
+                      << "ms / commit " << String(restoreReport->commitMs, 1)
+                      << "ms / first block " << String(restoreReport->firstAudioMs, 1) << "ms" << std::endl;
+        reportStatistics(blockTimes, totalAllocations, (double) totalLength / sampleRate, renderSeconds, sampleRate, blockSize,
+                         numLanes, model.getLaneScheduler().isParallelProcessingEnabled());
+        return 0;
+    }
+
+private:
+    bool addPlugin(const String& id, double sampleRate, int blockSize, int lane) {
+        auto& catalog = model.getPluginCatalog();
+        auto index = catalog.findIdentifier(id);
+        if (index < 0)
+            index = catalog.findName(id);
+        if (index < 0) {
+            std::cerr << "Plugin not found: " << id << " (use --list to see the scanned plugins)" << std::endl;
+            return false;
+        }
+
+        String error{};
+        auto instance = model.getPluginFormatManager().createPluginInstance(catalog.getDescription(index), sampleRate, blockSize, error);
+        if (instance == nullptr) {
+            std::cerr << "Failed to instantiate " << id << ": " << error << std::endl;
+            return false;
+        }
+        model.addActiveInstance(std::move(instance), lane);
+        return true;
+    }
+
+    bool loadMidiFile(const File& file, MidiMessageSequence& sequence) {
+        FileInputStream stream{file};
+        MidiFile midiFile{};
+        if (!stream.openedOk() || !midiFile.readFrom(stream)) {
+            std::cerr << "Cannot read the MIDI file: " << file.getFullPathName() << std::endl;
+            return false;
+        }
+        midiFile.convertTimestampTicksToSeconds();
+        for (int i = 0; i < midiFile.getNumTracks(); i++)
+            sequence.addSequence(*midiFile.getTrack(i), 0);
+        sequence.updateMatchedPairs();
+        return true;
+    }
+
+    static void reportStatistics(std::vector<double> blockTimes, int64 totalAllocations,
+                                 double audioSeconds, double renderSeconds, double sampleRate, int blockSize,
+                                 int numLanes, bool parallel) {
+        if (blockTimes.empty())
+            return;
+        std::sort(blockTimes.begin(), blockTimes.end());
+        double sum = 0;
+        for (auto t : blockTimes)
+            sum += t;
+        auto p99 = blockTimes[jmin(blockTimes.size() - 1, (size_t) ((double) blockTimes.size() * 0.99))];
+        auto deadline = blockSize / sampleRate;
+
+        std::cout << "lanes:           " << numLanes << (numLanes > 1 ? (parallel ? " (parallel)" : " (serial)") : "") << std::endl;
+        std::cout << "blocks:          " << blockTimes.size() << " x " << blockSize << " @ " << sampleRate << "Hz" << std::endl;
+        std::cout << "realtime factor: " << String(audioSeconds / renderSeconds, 2) << "x"
+                  << " (" << String(audioSeconds, 3) << "s rendered in " << String(renderSeconds, 3) << "s)" << std::endl;
+        std::cout << "block time (us): min " << String(blockTimes.front() * 1e6, 1)
+                  << " / mean " << String(sum / (double) blockTimes.size() * 1e6, 1)
+                  << " / p99 " << String(p99 * 1e6, 1)
+                  << " / deadline " << String(deadline * 1e6, 1) << std::endl;
+        std::cout << "allocations:     " << String((double) totalAllocations / (double) blockTimes.size(), 2)
+                  << " per block (" << totalAllocations << " total)" << std::endl;
+    }
+};
+
+static void printUsage() {
+    std::cout << "Usage: AndroidPluginHostRender [options] [pluginId...] [+ pluginId...]..." << std::endl
+              << "  +                      starts a new lane, processed in parallel with the previous ones" << std::endl
+              << "  --list                 list the scanned plugins and their IDs" << std::endl
+              << "  --import-plugins=FILE  add the plugins of a KnownPluginList XML file to the catalog" << std::endl
+              << "  --export-plugins=FILE  write the catalog as KnownPluginList XML" << std::endl
+              << "  --input=FILE           input audio (defaults to the embedded sample)" << std::endl
+              << "  --midi=FILE            MIDI file to feed the chain" << std::endl
+              << "  --output=FILE          output WAV file (omit for benchmarking only)" << std::endl
+              << "  --block-size=N         block size (default: 512)" << std::endl
+              << "  --tail=SECONDS         extra time to render after the input and the MIDI end (default: 1)" << std::endl
+              << "  --serial               process the lanes one after another on the render thread" << std::endl
+              << "  --session=FILE         restore the chain of a saved session (before any pluginId)" << std::endl
+              << "  --save-session=FILE    save the chain as a session before rendering" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    ScopedJuceInitialiser_GUI juceInitialiser{};
+    ArgumentList args{argc, argv};
+
+    if (args.containsOption("--help|-h")) {
+        printUsage();
+        return 0;
+    }
+
+    OfflineRenderer renderer{};
+    if (args.containsOption("--import-plugins"))
+        return renderer.importPlugins(args.getFileForOption("--import-plugins")) ? 0 : 1;
+    if (args.containsOption("--export-plugins"))
+        return renderer.exportPlugins(args.getFileForOption("--export-plugins")) ? 0 : 1;
+    if (args.containsOption("--list")) {
+        renderer.listPlugins();
+        return 0;
+    }
+
+    OfflineRenderer::Options options{};
+    options.lanes.add({});
+    for (auto& arg : args.arguments) {
+        if (arg.isOption())
+            continue;
+        if (arg.text != "+")
+            options.lanes.getReference(options.lanes.size() - 1).add(arg.text);
+        else if (options.lanes.size() < LaneScheduler::maxLanes)
+            options.lanes.add({});
+        else {
+            std::cerr << "Too many lanes (at most " << LaneScheduler::maxLanes << ")" << std::endl;
+            return 1;
+        }
+    }
+    options.serial = args.containsOption("--serial");
+    if (args.containsOption("--session"))
+        options.session = args.getFileForOption("--session");
+    if (args.containsOption("--save-session"))
+        options.saveSession = args.getFileForOption("--save-session");
+    if (args.containsOption("--input"))
+        options.input = args.getFileForOption("--input");
+    if (args.containsOption("--midi"))
+        options.midi = args.getFileForOption("--midi");
+    if (args.containsOption("--output"))
+        options.output = args.getFileForOption("--output");
+    if (args.containsOption("--block-size"))
+        options.blockSize = jmax(1, args.getValueForOption("--block-size").getIntValue());
+    if (args.containsOption("--tail"))
+        options.tailSeconds = jmax(0.0, args.getValueForOption("--tail").getDoubleValue());
+
+    return renderer.render(options);
+}
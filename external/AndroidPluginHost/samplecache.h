@@ -0,0 +1,149 @@
+#ifndef ANDROIDPLUGINHOST_SAMPLECACHE_H
+#define ANDROIDPLUGINHOST_SAMPLECACHE_H
+
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <map>
+#include <juce_audio_formats/juce_audio_formats.h>
+
+using namespace juce;
+
+// Fully decoded audio at a fixed sample rate. All channels live in one allocation and each of them starts
+// on a SIMD (and cache line) boundary, so that the audio thread can just copy from it.
+class DecodedSample : public ReferenceCountedObject {
+    static constexpr size_t alignment = 64;
+    HeapBlock<char> storage{};
+    Array<float*> channels{};
+    int64 length;
+    double sampleRate;
+
+public:
+    using Ptr = ReferenceCountedObjectPtr<DecodedSample>;
+
+    DecodedSample(int numChannels, int64 length, double sampleRate) : length(length), sampleRate(sampleRate) {
+        auto stride = ((size_t) length * sizeof(float) + alignment - 1) / alignment * alignment;
+        storage.calloc(stride * (size_t) numChannels + alignment);
+        auto base = (char*) (((pointer_sized_uint) storage.get() + alignment - 1) & ~(pointer_sized_uint) (alignment - 1));
+        for (int ch = 0; ch < numChannels; ch++)
+            channels.add((float*) (base + stride * (size_t) ch));
+    }
+
+    int getNumChannels() const { return channels.size(); }
+    int64 getLength() const { return length; }
+    double getSampleRate() const { return sampleRate; }
+    size_t getSizeInBytes() const { return (size_t) length * sizeof(float) * (size_t) channels.size(); }
+    const float* getReadPointer(int channel) const { return channels.getUnchecked(channel); }
+    float* getWritePointer(int channel) { return channels.getUnchecked(channel); }
+
+    // Decodes the whole reader and converts it to the target sample rate. Blocks, so do not call it on the audio thread.
+    static Ptr decode(AudioFormatReader& reader, double targetSampleRate) {
+        auto numChannels = (int) reader.numChannels;
+        auto sourceLength = (int) jmin(reader.lengthInSamples, (int64) std::numeric_limits<int>::max() - padding);
+        if (numChannels == 0 || sourceLength <= 0 || reader.sampleRate <= 0)
+            return new DecodedSample(0, 0, targetSampleRate);
+
+        if (reader.sampleRate == targetSampleRate) {
+            Ptr sample = new DecodedSample(numChannels, sourceLength, targetSampleRate);
+            AudioBuffer<float> view{sample->channels.getRawDataPointer(), numChannels, sourceLength};
+            reader.read(&view, 0, sourceLength, 0, true, true);
+            return sample;
+        }
+
+        // The interpolator's output lags its input by its latency, so that much input is fed before the first output
+        // sample, and the same amount of silence (plus what it reads ahead) goes after the end for the tail.
+        auto ratio = reader.sampleRate / targetSampleRate;
+        auto latency = (int) std::ceil(WindowedSincInterpolator::getBaseLatency());
+        auto readAhead = latency + (int) std::ceil(ratio) + 1;
+        AudioBuffer<float> source{numChannels, sourceLength + jmax(padding, readAhead)};
+        source.clear();
+        reader.read(&source, 0, sourceLength, 0, true, true);
+        auto length = (int64) std::ceil(sourceLength / ratio);
+        Ptr sample = new DecodedSample(numChannels, length, targetSampleRate);
+        HeapBlock<float> discarded{(size_t) latency};
+        for (int ch = 0; ch < numChannels; ch++) {
+            WindowedSincInterpolator interpolator{};
+            auto input = source.getReadPointer(ch);
+            interpolator.process(1.0, input, discarded.get(), latency);
+            interpolator.process(ratio, input + latency, sample->getWritePointer(ch), (int) length);
+        }
+        return sample;
+    }
+
+private:
+    static constexpr int padding = 256;
+};
+
+// Decodes on a background thread, once per source and sample rate. Least recently requested samples are
+// dropped from the cache (not from playback) when it exceeds the budget.
+class SampleCache {
+public:
+    using ReaderFactory = std::function<std::unique_ptr<AudioFormatReader>()>;
+    using Callback = std::function<void(DecodedSample::Ptr)>;
+
+    explicit SampleCache(size_t maxBytes = 256 * 1024 * 1024) : maxBytes(maxBytes) {}
+
+    ~SampleCache() {
+        pool.removeAllJobs(true, 10000);
+    }
+
+    // onReady is invoked on the decoding thread, or synchronously if the sample is already there.
+    void request(const String& key, double sampleRate, ReaderFactory createReader, Callback onReady) {
+        auto cacheKey = key + "@" + String(sampleRate);
+        {
+            const ScopedLock sl(lock);
+            auto it = samples.find(cacheKey);
+            if (it != samples.end()) {
+                it->second.lastUsed = ++useCounter;
+                onReady(it->second.sample);
+                return;
+            }
+        }
+        pool.addJob([this, cacheKey, sampleRate, createReader, onReady] {
+            auto reader = createReader();
+            if (reader == nullptr)
+                return;
+            auto sample = DecodedSample::decode(*reader, sampleRate);
+            {
+                const ScopedLock sl(lock);
+                samples[cacheKey] = Entry{sample, ++useCounter};
+                evict();
+            }
+            onReady(sample);
+        });
+    }
+
+    void clear() {
+        const ScopedLock sl(lock);
+        samples.clear();
+    }
+
+private:
+    struct Entry {
+        DecodedSample::Ptr sample{};
+        int64 lastUsed{0};
+    };
+
+    size_t maxBytes;
+    ThreadPool pool{1};
+    CriticalSection lock{};
+    std::map<String, Entry> samples{};
+    int64 useCounter{0};
+
+    void evict() {
+        for (;;) {
+            size_t total = 0;
+            auto oldest = samples.end();
+            for (auto it = samples.begin(); it != samples.end(); ++it) {
+                total += it->second.sample->getSizeInBytes();
+                if (oldest == samples.end() || it->second.lastUsed < oldest->second.lastUsed)
+                    oldest = it;
+            }
+            if (total <= maxBytes || samples.size() <= 1)
+                return;
+            samples.erase(oldest);
+        }
+    }
+};
+
+#endif //ANDROIDPLUGINHOST_SAMPLECACHE_H
@@ -0,0 +1,455 @@
+#ifndef ANDROIDPLUGINHOST_SCANNER_H
+#define ANDROIDPLUGINHOST_SCANNER_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <set>
+#include <juce_events/juce_events.h>
+#include <juce_audio_processors/juce_audio_processors.h>
+
+using namespace juce;
+
+// There is no way to launch our own executable as a child process on mobile, so we probe in-process there.
+#if JUCE_ANDROID || JUCE_IOS
+#define ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN 0
+#else
+#define ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN 1
+#endif
+
+#define PLUGIN_SCAN_WORKER_UID "androidpluginhost-plugin-scan-worker"
+#define PLUGIN_SCAN_PING_TIMEOUT_MS 10000
+#define PLUGIN_SCAN_FILE_TIMEOUT_MS 30000
+
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+namespace PluginScanProtocol {
+    inline MemoryBlock toMemoryBlock(const XmlElement& xml) {
+        auto s = xml.toString(XmlElement::TextFormat().singleLine().withoutHeader());
+        return MemoryBlock{s.toRawUTF8(), s.getNumBytesAsUTF8()};
+    }
+
+    inline MemoryBlock createRequest(const String& formatName, const String& fileOrIdentifier) {
+        XmlElement xml{"SCAN"};
+        xml.setAttribute("format", formatName);
+        xml.setAttribute("file", fileOrIdentifier);
+        return toMemoryBlock(xml);
+    }
+}
+
+// Runs in the child process, i.e. when the app is launched with PLUGIN_SCAN_WORKER_UID on the command line.
+class PluginScanWorker : public ChildProcessWorker {
+    AudioPluginFormatManager formatManager{};
+
+public:
+    PluginScanWorker() {
+        formatManager.addDefaultFormats();
+    }
+
+    void handleMessageFromCoordinator(const MemoryBlock& data) override {
+        // some formats expect to be instantiated on the message thread.
+        MessageManager::callAsync([this, data] { scan(data); });
+    }
+
+    void handleConnectionLost() override {
+        MessageManager::callAsync([] { JUCEApplicationBase::quit(); });
+    }
+
+private:
+    void scan(const MemoryBlock& data) {
+        XmlElement result{"RESULT"};
+        result.setAttribute("ok", false);
+        auto request = parseXML(data.toString());
+        if (request != nullptr) {
+            auto formatName = request->getStringAttribute("format");
+            auto fileOrIdentifier = request->getStringAttribute("file");
+            for (auto format : formatManager.getFormats()) {
+                if (format->getName() != formatName)
+                    continue;
+                OwnedArray<PluginDescription> found{};
+                try {
+                    format->findAllTypesForFile(found, fileOrIdentifier);
+                    result.setAttribute("ok", true);
+                } catch(std::exception&) {
+                    // reported as a failure below
+                } catch(...) {
+                }
+                for (auto desc : found)
+                    result.addChildElement(desc->createXml().release());
+                break;
+            }
+        }
+        sendMessageToCoordinator(PluginScanProtocol::toMemoryBlock(result));
+    }
+};
+#endif
+
+// Scans the files of a format on a thread pool, reusing the results of files that did not change since the last
+// scan. Probing runs in a worker process where there is one, one per job, so probes run in parallel there.
+// In-process probing (mobile, or when the worker cannot be launched) goes through the message thread, as
+// formats do not promise that findAllTypesForFile() works anywhere else; there the probes run one at a time,
+// and the pool only parallelizes fingerprinting and the cache lookups.
+class PluginScanner : private Timer {
+public:
+    enum class Outcome {
+        pending,
+        cached,
+        probed,
+        failed,
+        crashed,
+        timedOut
+    };
+
+    // The cache is a file of its own that is only read while scanning, so that it does not slow down every launch.
+    PluginScanner(KnownPluginList& knownPluginList, File cacheFile, File inFlightFile)
+    : list(knownPluginList), cacheFile(cacheFile), inFlightFile(inFlightFile) {
+        // anything left over from a previous session crashed the whole host while being probed in-process.
+        PluginDirectoryScanner::applyBlacklistingsFromDeadMansPedal(list, inFlightFile);
+        inFlightFile.deleteFile();
+    }
+
+    ~PluginScanner() override {
+        stopTimer();
+        pool.removeAllJobs(true, PLUGIN_SCAN_FILE_TIMEOUT_MS);
+    }
+
+    // Both callbacks are invoked on the message thread.
+    std::function<void(int done, int total, const String& currentFile)> onProgress{};
+    std::function<void()> onFinished{};
+
+    bool isScanning() const { return format != nullptr; }
+
+    void scan(AudioPluginFormat* formatToScan) {
+        if (isScanning())
+            return;
+        format = formatToScan;
+
+        entries.clear();
+        for (auto& file : format->searchPathsForPlugins(format->getDefaultLocationsToSearch(), true)) {
+            if (list.getBlacklistedFiles().contains(file))
+                continue;
+            auto entry = entries.add(new Entry{});
+            entry->fileOrIdentifier = file;
+        }
+
+        cache = parseXMLIfTagMatches(cacheFile, "PLUGIN_SCAN_CACHE");
+        if (cache == nullptr)
+            cache = std::make_unique<XmlElement>("PLUGIN_SCAN_CACHE");
+        cacheIndex.clear();
+        for (auto* item : cache->getChildWithTagNameIterator("ENTRY"))
+            if (item->getStringAttribute("format") == format->getName())
+                cacheIndex[item->getStringAttribute("file")] = item;
+
+        nextEntry = 0;
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+        workerUnavailable = false;
+#endif
+        lastStartedEntry = 0;
+        numCompleted = 0;
+        for (int i = 0, n = jmin(pool.getNumThreads(), entries.size()); i < n; i++)
+            pool.addJob(new ScanJob(*this), true);
+        startTimer(100);
+    }
+
+private:
+    struct Entry {
+        String fileOrIdentifier{};
+        bool hasFingerprint{false};
+        int64 lastModified{0};
+        int64 size{0};
+        Outcome outcome{Outcome::pending};
+        OwnedArray<PluginDescription> types{};
+    };
+
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+    class ChildProcess : public ChildProcessCoordinator {
+        CriticalSection lock{};
+        WaitableEvent replied{};
+        MemoryBlock reply{};
+        std::atomic<bool> connectionLost{false};
+        bool running{false};
+
+    public:
+        ~ChildProcess() override { killWorkerProcess(); }
+
+        bool ensureLaunched() {
+            if (running && !connectionLost)
+                return true;
+            killWorkerProcess();
+            connectionLost = false;
+            running = launchWorkerProcess(File::getSpecialLocation(File::currentExecutableFile),
+                                          PLUGIN_SCAN_WORKER_UID, PLUGIN_SCAN_PING_TIMEOUT_MS);
+            return running;
+        }
+
+        Outcome probe(const String& formatName, const String& fileOrIdentifier,
+                      OwnedArray<PluginDescription>& results, const std::function<bool()>& shouldExit) {
+            {
+                const ScopedLock sl(lock);
+                reply.reset();
+            }
+            replied.reset();
+            if (!sendMessageToWorker(PluginScanProtocol::createRequest(formatName, fileOrIdentifier))) {
+                running = false;
+                return Outcome::crashed;
+            }
+
+            // poll so that a crash or a cancellation is noticed without waiting for the whole timeout.
+            auto start = Time::getMillisecondCounter();
+            while (!replied.wait(50)) {
+                if (connectionLost) {
+                    running = false;
+                    return Outcome::crashed;
+                }
+                if (shouldExit() || Time::getMillisecondCounter() - start > PLUGIN_SCAN_FILE_TIMEOUT_MS) {
+                    killWorkerProcess();
+                    running = false;
+                    return Outcome::timedOut;
+                }
+            }
+
+            std::unique_ptr<XmlElement> xml{};
+            {
+                const ScopedLock sl(lock);
+                xml = parseXML(reply.toString());
+            }
+            if (xml == nullptr) {
+                running = false;
+                return Outcome::crashed;
+            }
+            for (auto* item : xml->getChildWithTagNameIterator("PLUGIN")) {
+                PluginDescription desc{};
+                if (desc.loadFromXml(*item))
+                    results.add(new PluginDescription(desc));
+            }
+            return xml->getBoolAttribute("ok") ? Outcome::probed : Outcome::failed;
+        }
+
+        void handleMessageFromWorker(const MemoryBlock& data) override {
+            {
+                const ScopedLock sl(lock);
+                reply = data;
+            }
+            replied.signal();
+        }
+
+        void handleConnectionLost() override {
+            connectionLost = true;
+        }
+    };
+#endif
+
+    // Shared between a ScanJob and the message thread, as the job may give up on it before it gets run.
+    struct InProcessProbe : public ReferenceCountedObject {
+        using Ptr = ReferenceCountedObjectPtr<InProcessProbe>;
+        CriticalSection lock{};
+        WaitableEvent done{};
+        bool cancelled{false};
+        Outcome outcome{Outcome::pending};
+        OwnedArray<PluginDescription> types{};
+    };
+
+    class ScanJob : public ThreadPoolJob {
+        PluginScanner& owner;
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+        ChildProcess childProcess{};
+#endif
+
+    public:
+        explicit ScanJob(PluginScanner& owner) : ThreadPoolJob("PluginScanJob"), owner(owner) {}
+
+        JobStatus runJob() override {
+            for (int i; !shouldExit() && (i = owner.nextEntry++) < owner.entries.size(); ++owner.numCompleted) {
+                owner.lastStartedEntry = i;
+                auto& entry = *owner.entries[i];
+                fingerprint(entry);
+                if (owner.restoreFromCache(entry))
+                    entry.outcome = Outcome::cached;
+                else
+                    entry.outcome = probe(entry);
+            }
+            return jobHasFinished;
+        }
+
+    private:
+        Outcome probe(Entry& entry) {
+            auto& format = *owner.format;
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+            if (!owner.workerUnavailable) {
+                if (childProcess.ensureLaunched())
+                    return childProcess.probe(format.getName(), entry.fileOrIdentifier, entry.types,
+                                              [this] { return shouldExit(); });
+                owner.workerUnavailable = true; // the rest of the scan probes in-process
+            }
+#endif
+            // some formats expect to be instantiated on the message thread, so the probe runs there, one at a time
+            // no matter how many jobs are waiting for it.
+            owner.setInFlight(entry.fileOrIdentifier, true);
+            InProcessProbe::Ptr request{new InProcessProbe{}};
+            auto formatToProbe = &format;
+            auto fileOrIdentifier = entry.fileOrIdentifier;
+            MessageManager::callAsync([request, formatToProbe, fileOrIdentifier] {
+                const ScopedLock sl(request->lock);
+                if (request->cancelled)
+                    return;
+                request->outcome = Outcome::probed;
+                try {
+                    formatToProbe->findAllTypesForFile(request->types, fileOrIdentifier);
+                } catch(std::exception&) {
+                    // swallow scanner failures
+                    request->outcome = Outcome::failed;
+                } catch(...) {
+                    request->outcome = Outcome::failed;
+                }
+                request->done.signal();
+            });
+            // the scanner is destroyed on the message thread, which must not wait for a probe it has yet to run.
+            while (!request->done.wait(50)) {
+                if (!shouldExit())
+                    continue;
+                const ScopedLock sl(request->lock);
+                if (request->outcome == Outcome::pending) {
+                    request->cancelled = true;
+                    break;
+                }
+            }
+            owner.setInFlight(entry.fileOrIdentifier, false);
+            if (!request->cancelled)
+                entry.types.swapWith(request->types);
+            return request->outcome;
+        }
+    };
+
+    KnownPluginList& list;
+    File cacheFile;
+    File inFlightFile;
+    ThreadPool pool{jmax(1, SystemStats::getNumCpuCores())};
+
+    AudioPluginFormat* format{nullptr};
+    OwnedArray<Entry> entries{};
+    std::unique_ptr<XmlElement> cache{};
+    std::map<String, const XmlElement*> cacheIndex{};
+    std::atomic<int> nextEntry{0}, lastStartedEntry{0}, numCompleted{0};
+#if ANDROIDPLUGINHOST_OUT_OF_PROCESS_SCAN
+    // set once a worker process failed to launch, so that the other jobs do not wait for the ping timeout again.
+    std::atomic<bool> workerUnavailable{false};
+#endif
+
+    CriticalSection inFlightLock{};
+    StringArray inFlight{};
+
+    // Bundles are directories whose own timestamp does not change when the binary inside is replaced.
+    static void fingerprint(Entry& entry) {
+        if (!File::isAbsolutePath(entry.fileOrIdentifier))
+            return; // non-file identifiers (e.g. AAP services) are always probed.
+        File file{entry.fileOrIdentifier};
+        if (!file.exists())
+            return;
+        if (file.isDirectory()) {
+            for (auto& item : RangedDirectoryIterator(file, true, "*", File::findFiles)) {
+                entry.size += item.getFileSize();
+                entry.lastModified = jmax(entry.lastModified, item.getModificationTime().toMilliseconds());
+            }
+        } else {
+            entry.size = file.getSize();
+            entry.lastModified = file.getLastModificationTime().toMilliseconds();
+        }
+        entry.hasFingerprint = true;
+    }
+
+    // called from the pool threads; the cache is not modified until all jobs are done.
+    bool restoreFromCache(Entry& entry) {
+        if (!entry.hasFingerprint)
+            return false;
+        auto it = cacheIndex.find(entry.fileOrIdentifier);
+        if (it == cacheIndex.end())
+            return false;
+        auto item = it->second;
+        if (item->getStringAttribute("mtime").getLargeIntValue() != entry.lastModified ||
+            item->getStringAttribute("size").getLargeIntValue() != entry.size)
+            return false;
+        for (auto* child : item->getChildWithTagNameIterator("PLUGIN")) {
+            PluginDescription desc{};
+            if (desc.loadFromXml(*child))
+                entry.types.add(new PluginDescription(desc));
+        }
+        return true;
+    }
+
+    void setInFlight(const String& fileOrIdentifier, bool starting) {
+        const ScopedLock sl(inFlightLock);
+        if (starting)
+            inFlight.add(fileOrIdentifier);
+        else
+            inFlight.removeString(fileOrIdentifier);
+        if (inFlight.isEmpty())
+            inFlightFile.deleteFile();
+        else
+            inFlightFile.replaceWithText(inFlight.joinIntoString("\n"));
+    }
+
+    void timerCallback() override {
+        int done = numCompleted;
+        if (onProgress && done < entries.size())
+            onProgress(done, entries.size(), entries[lastStartedEntry]->fileOrIdentifier);
+        if (done == entries.size() && pool.getNumJobs() == 0)
+            finish();
+    }
+
+    void finish() {
+        stopTimer();
+
+        std::set<String> unchanged{};
+        for (auto entry : entries) {
+            switch (entry->outcome) {
+                case Outcome::cached:
+                    unchanged.insert(entry->fileOrIdentifier);
+                    break;
+                case Outcome::failed:
+                case Outcome::crashed:
+                case Outcome::timedOut:
+                    list.addToBlacklist(entry->fileOrIdentifier);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // drop types whose files vanished, changed, or got blacklisted. Unchanged ones are kept as is.
+        for (auto& desc : list.getTypesForFormat(*format))
+            if (unchanged.find(desc.fileOrIdentifier) == unchanged.end())
+                list.removeType(desc);
+        for (auto entry : entries)
+            for (auto desc : entry->types)
+                if (desc->pluginFormatName == format->getName())
+                    list.addType(*desc);
+
+        saveCache();
+
+        format = nullptr;
+        entries.clear();
+        if (onFinished)
+            onFinished();
+    }
+
+    void saveCache() {
+        for (int i = cache->getNumChildElements(); --i >= 0;)
+            if (cache->getChildElement(i)->getStringAttribute("format") == format->getName())
+                cache->removeChildElement(cache->getChildElement(i), true);
+        for (auto entry : entries) {
+            if (!entry->hasFingerprint || (entry->outcome != Outcome::cached && entry->outcome != Outcome::probed))
+                continue;
+            auto item = cache->createNewChildElement("ENTRY");
+            item->setAttribute("format", format->getName());
+            item->setAttribute("file", entry->fileOrIdentifier);
+            item->setAttribute("mtime", String(entry->lastModified));
+            item->setAttribute("size", String(entry->size));
+            for (auto desc : entry->types)
+                item->addChildElement(desc->createXml().release());
+        }
+        cacheIndex.clear();
+        cache->writeTo(cacheFile);
+        cache.reset();
+    }
+};
+
+#endif //ANDROIDPLUGINHOST_SCANNER_H
@@ -0,0 +1,178 @@
+#ifndef ANDROIDPLUGINHOST_SESSION_H
+#define ANDROIDPLUGINHOST_SESSION_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <juce_audio_processors/juce_audio_processors.h>
+
+using namespace juce;
+
+// The plugin chain of every lane with the plugin states, and the graph settings.
+struct Session {
+    static constexpr int formatVersion = 1;
+
+    struct Node {
+        PluginDescription description{};
+        int lane{0};
+        MemoryBlock state{};
+    };
+
+    double sampleRate{0};
+    int blockSize{0};
+    bool parallelLanes{true};
+    std::vector<Node> nodes{}; // in chain order within each lane
+
+    std::unique_ptr<XmlElement> createXml() const {
+        auto xml = std::make_unique<XmlElement>("SESSION");
+        xml->setAttribute("version", formatVersion);
+        xml->setAttribute("sampleRate", sampleRate);
+        xml->setAttribute("blockSize", blockSize);
+        xml->setAttribute("parallelLanes", parallelLanes);
+        for (auto& node : nodes) {
+            auto child = xml->createNewChildElement("NODE");
+            child->setAttribute("lane", node.lane);
+            child->addChildElement(node.description.createXml().release());
+            child->createNewChildElement("STATE")->addTextElement(node.state.toBase64Encoding());
+        }
+        return xml;
+    }
+
+    bool loadFromXml(const XmlElement& xml) {
+        if (!xml.hasTagName("SESSION") || xml.getIntAttribute("version") > formatVersion)
+            return false;
+        sampleRate = xml.getDoubleAttribute("sampleRate");
+        blockSize = xml.getIntAttribute("blockSize");
+        parallelLanes = xml.getBoolAttribute("parallelLanes", true);
+        nodes.clear();
+        for (auto child : xml.getChildWithTagNameIterator("NODE")) {
+            Node node{};
+            auto plugin = child->getChildByName("PLUGIN");
+            if (plugin == nullptr || !node.description.loadFromXml(*plugin))
+                continue;
+            node.lane = child->getIntAttribute("lane");
+            if (auto state = child->getChildByName("STATE"))
+                node.state.fromBase64Encoding(state->getAllSubText());
+            nodes.push_back(std::move(node));
+        }
+        return true;
+    }
+
+    bool save(const File& file) const { return createXml()->writeTo(file); }
+
+    bool load(const File& file) {
+        auto xml = parseXML(file);
+        return xml != nullptr && loadFromXml(*xml);
+    }
+};
+
+// Requests all the instances of a session at once, so that formats that instantiate asynchronously (e.g. AAP,
+// which binds to a service per plugin) do it concurrently. Once every request is answered, the states are
+// applied before anything gets processed, and the whole chain is handed over at once.
+// The timings of each phase and the time to the first audio callback after that are reported.
+class SessionRestore : private Timer {
+public:
+    struct Report {
+        Array<AudioProcessorGraph::Node::Ptr> nodes{};
+        StringArray errors{};
+        double instantiateMs{0};
+        double applyStateMs{0};
+        double commitMs{0};
+        double firstAudioMs{-1};         // since the restore started; -1 if there is nothing to measure it with
+        double launchToFirstAudioMs{-1};
+    };
+
+    using Instantiator = std::function<void(const PluginDescription&, AudioPluginFormat::PluginCreationCallback)>;
+    // Gets the instances in session order (nullptr for the ones that failed) and returns the nodes they went into.
+    using Commit = std::function<Array<AudioProcessorGraph::Node::Ptr>(std::vector<std::unique_ptr<AudioPluginInstance>>&)>;
+    // Returns the ticks of the first audio callback after the commit, or 0 until there is one.
+    using FirstAudioProbe = std::function<int64()>;
+
+    SessionRestore(Session session, int64 launchTicks, Commit commit, FirstAudioProbe probe, std::function<void(const Report&)> onFinished)
+    : session(std::move(session)), launchTicks(launchTicks), commit(std::move(commit)), probe(std::move(probe)),
+      onFinished(std::move(onFinished)) {}
+
+    ~SessionRestore() override { stopTimer(); }
+
+    const Session& getSession() const { return session; }
+    bool isRestoring() const { return pending > 0; }
+
+    // The instantiator may call back synchronously, in which case everything is done when this returns.
+    void start(Instantiator instantiate) {
+        startTicks = Time::getHighResolutionTicks();
+        instances.resize(session.nodes.size());
+        pending = (int) session.nodes.size();
+        if (pending == 0) {
+            commitAll();
+            return;
+        }
+        WeakReference<SessionRestore> weakThis{this};
+        for (size_t i = 0; i < session.nodes.size(); i++)
+            instantiate(session.nodes[i].description, [weakThis, i](std::unique_ptr<AudioPluginInstance> instance, const String& error) {
+                if (weakThis != nullptr)
+                    weakThis->instantiated(i, std::move(instance), error);
+            });
+    }
+
+private:
+    Session session;
+    int64 launchTicks;
+    Commit commit;
+    FirstAudioProbe probe;
+    std::function<void(const Report&)> onFinished;
+
+    std::vector<std::unique_ptr<AudioPluginInstance>> instances{};
+    int pending{0};
+    int64 startTicks{0};
+    int64 committedTicks{0};
+    Report report{};
+
+    static double toMs(int64 ticks) { return Time::highResolutionTicksToSeconds(ticks) * 1000.0; }
+
+    void instantiated(size_t index, std::unique_ptr<AudioPluginInstance> instance, const String& error) {
+        if (instance == nullptr)
+            report.errors.add(session.nodes[index].description.descriptiveName + ": " + error);
+        instances[index] = std::move(instance);
+        if (--pending == 0)
+            commitAll();
+    }
+
+    void commitAll() {
+        auto instantiated = Time::getHighResolutionTicks();
+        report.instantiateMs = toMs(instantiated - startTicks);
+
+        for (size_t i = 0; i < instances.size(); i++) {
+            auto& state = session.nodes[i].state;
+            if (instances[i] != nullptr && !state.isEmpty())
+                instances[i]->setStateInformation(state.getData(), (int) state.getSize());
+        }
+        auto stateApplied = Time::getHighResolutionTicks();
+        report.applyStateMs = toMs(stateApplied - instantiated);
+
+        report.nodes = commit(instances);
+        committedTicks = Time::getHighResolutionTicks();
+        report.commitMs = toMs(committedTicks - stateApplied);
+
+        if (probe)
+            startTimer(1);
+        else
+            onFinished(report);
+    }
+
+    void timerCallback() override {
+        auto ticks = probe();
+        // a device that never calls back (e.g. it failed to open) should not keep us polling forever.
+        if (ticks == 0 && toMs(Time::getHighResolutionTicks() - committedTicks) < 10000)
+            return;
+        stopTimer();
+        if (ticks != 0) {
+            report.firstAudioMs = toMs(ticks - startTicks);
+            report.launchToFirstAudioMs = toMs(ticks - launchTicks);
+        }
+        onFinished(report);
+    }
+
+    JUCE_DECLARE_WEAK_REFERENCEABLE(SessionRestore)
+};
+
+#endif //ANDROIDPLUGINHOST_SESSION_H
@@ -0,0 +1,65 @@
+#ifndef ANDROIDPLUGINHOST_TOPOLOGY_H
+#define ANDROIDPLUGINHOST_TOPOLOGY_H
+
+#include <set>
+#include <vector>
+#include <juce_audio_processors/juce_audio_processors.h>
+
+using namespace juce;
+
+struct TopologyChange {
+    std::vector<AudioProcessorGraph::Connection> connectionsToRemove{};
+    std::vector<AudioProcessorGraph::Connection> connectionsToAdd{};
+
+    bool isEmpty() const { return connectionsToRemove.empty() && connectionsToAdd.empty(); }
+
+    // The minimal set of connection changes that turns the current graph into the desired one.
+    static TopologyChange compute(AudioProcessorGraph& graph, const std::set<AudioProcessorGraph::Connection>& desired) {
+        std::set<AudioProcessorGraph::Connection> current{};
+        TopologyChange change{};
+        for (auto& connection : graph.getConnections()) {
+            current.insert(connection);
+            if (desired.find(connection) == desired.end())
+                change.connectionsToRemove.push_back(connection);
+        }
+        for (auto& connection : desired)
+            if (current.find(connection) == current.end())
+                change.connectionsToAdd.push_back(connection);
+        return change;
+    }
+
+    // Async updates are coalesced, so the whole batch results in a single render sequence rebuild.
+    void applyTo(AudioProcessorGraph& graph) const {
+        for (auto& connection : connectionsToRemove)
+            graph.removeConnection(connection, AudioProcessorGraph::UpdateKind::async);
+        for (auto& connection : connectionsToAdd)
+            graph.addConnection(connection, AudioProcessorGraph::UpdateKind::async);
+    }
+};
+
+// Collects connections, skipping the ones the graph would reject (e.g. channels that do not exist).
+class DesiredConnections {
+    AudioProcessorGraph& graph;
+    std::set<AudioProcessorGraph::Connection> connections{};
+
+public:
+    explicit DesiredConnections(AudioProcessorGraph& graph) : graph(graph) {}
+
+    void add(AudioProcessorGraph::Connection connection) {
+        if (graph.isConnected(connection) || graph.canConnect(connection))
+            connections.insert(connection);
+    }
+
+    void addAudio(AudioProcessorGraph::NodeID source, AudioProcessorGraph::NodeID destination) {
+        for (int channel = 0; channel < 2; ++channel)
+            add({ { source, channel }, { destination, channel } });
+    }
+
+    void addMidi(AudioProcessorGraph::NodeID source, AudioProcessorGraph::NodeID destination) {
+        add({ { source, AudioProcessorGraph::midiChannelIndex }, { destination, AudioProcessorGraph::midiChannelIndex } });
+    }
+
+    const std::set<AudioProcessorGraph::Connection>& get() const { return connections; }
+};
+
+#endif //ANDROIDPLUGINHOST_TOPOLOGY_H